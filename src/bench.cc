@@ -0,0 +1,426 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Micro-benchmarks for the decoder, feature and selection hot paths.
+
+   Usage: extractor_bench [video]
+
+   Without an input video, synthetic test videos are encoded into the
+   temp directory first (libx264 when available, MPEG-4 otherwise).
+ */
+
+#include "decoder.hh"
+#include "features.hh"
+#include "selection.hh"
+#include "libcvalgo/histogram_diff.hh"
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+
+extern "C" {
+#include "libavutil/opt.h"
+}
+
+
+// --- allocation counting (C++ heap only, libav* allocations are not seen) ---
+
+static std::atomic<long> nAllocations(0);
+
+void* operator new(size_t size)
+{
+  nAllocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete[](void* p) noexcept { free(p); }
+
+
+// --- measurement ---
+
+const int nRepetitions = 7;
+
+
+/* Run 'op' (which performs 'opsPerRun' operations) repeatedly and print
+   median/min/stddev of the time per operation.
+   If 'framesPerOp' is set, decoding throughput is printed as well.
+ */
+void measure(const char* name, int opsPerRun, std::function<void()> op,
+             double framesPerOp = 0)
+{
+  op(); // warm-up
+
+  std::vector<double> nsPerOp;
+  long allocs = 0;
+
+  for (int r=0;r<nRepetitions;r++) {
+    long allocsBefore = nAllocations;
+    auto start = std::chrono::steady_clock::now();
+
+    op();
+
+    auto end = std::chrono::steady_clock::now();
+    allocs += nAllocations - allocsBefore;
+
+    double ns = std::chrono::duration<double, std::nano>(end-start).count();
+    nsPerOp.push_back(ns / opsPerRun);
+  }
+
+  std::sort(nsPerOp.begin(), nsPerOp.end());
+
+  double mean=0;
+  for (double t : nsPerOp) mean += t;
+  mean /= nsPerOp.size();
+
+  double var=0;
+  for (double t : nsPerOp) var += (t-mean)*(t-mean);
+  double stddev = sqrt(var / nsPerOp.size());
+
+  double median = nsPerOp[nsPerOp.size()/2];
+
+  printf("%-40s %14.0f ns/op  (min %12.0f, +-%5.1f%%)  %8.1f allocs/op",
+         name, median, nsPerOp[0], 100*stddev/mean,
+         double(allocs) / (nRepetitions*opsPerRun));
+
+  if (framesPerOp > 0) {
+    printf("  %8.1f frames/s", framesPerOp * 1e9 / median);
+  }
+
+  printf("\n");
+}
+
+
+// --- synthetic test video ---
+
+static void drawFrame(AVFrame* frame, int n, int sceneLength)
+{
+  int scene = n / sceneLength;
+
+  for (int y=0;y<frame->height;y++)
+    for (int x=0;x<frame->width;x++) {
+      int v;
+      switch (scene % 3) {
+      case 0:  v = x + y + 3*n; break;                    // moving gradient
+      case 1:  v = ((x/16 + y/16 + n/4) & 1) ? 200 : 40;  break; // checkerboard
+      default: v = (x*x + y*y) / 64 + 5*n; break;        // rings
+      }
+      frame->data[0][y*frame->linesize[0]+x] = v & 0xFF;
+    }
+
+  for (int y=0;y<frame->height/2;y++)
+    for (int x=0;x<frame->width/2;x++) {
+      frame->data[1][y*frame->linesize[1]+x] = (64*scene + x) & 0xFF;
+      frame->data[2][y*frame->linesize[2]+x] = (128 + 32*scene + y) & 0xFF;
+    }
+}
+
+
+bool generateVideo(const char* filename, int width, int height, int nFrames, int gopSize)
+{
+  AVFormatContext* oc = NULL;
+  if (avformat_alloc_output_context2(&oc, NULL, NULL, filename) < 0) {
+    return false;
+  }
+
+  AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+  if (!codec) codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+  if (!codec) return false;
+
+  AVStream* stream = avformat_new_stream(oc, codec);
+  AVCodecContext* enc = stream->codec;
+  enc->width  = width;
+  enc->height = height;
+  enc->pix_fmt = AV_PIX_FMT_YUV420P;
+  enc->time_base.num = 1;
+  enc->time_base.den = 25;
+  enc->gop_size = gopSize;
+  enc->max_b_frames = 2;
+  enc->bit_rate = 2000000;
+  stream->time_base = enc->time_base;
+
+  if (oc->oformat->flags & AVFMT_GLOBALHEADER) {
+    enc->flags |= CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  AVDictionary* opts = NULL;
+  if (codec->id == AV_CODEC_ID_H264) {
+    av_dict_set(&opts, "preset", "ultrafast", 0);
+  }
+
+  int err = avcodec_open2(enc, codec, &opts);
+  av_dict_free(&opts);
+  if (err < 0) return false;
+
+  if (avio_open(&oc->pb, filename, AVIO_FLAG_WRITE) < 0) {
+    return false;
+  }
+
+  if (avformat_write_header(oc, NULL) < 0) {
+    return false;
+  }
+
+  AVFrame* frame = av_frame_alloc();
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width  = width;
+  frame->height = height;
+  av_frame_get_buffer(frame, 32);
+
+  for (int n=0;;n++) {
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+
+    int got_packet = 0;
+
+    if (n<nFrames) {
+      drawFrame(frame, n, 3*gopSize/2);
+      frame->pts = n;
+      avcodec_encode_video2(enc, &packet, frame, &got_packet);
+    }
+    else {
+      // flush delayed frames out of the encoder
+      avcodec_encode_video2(enc, &packet, NULL, &got_packet);
+      if (!got_packet) break;
+    }
+
+    if (got_packet) {
+      av_packet_rescale_ts(&packet, enc->time_base, stream->time_base);
+      packet.stream_index = stream->index;
+      av_interleaved_write_frame(oc, &packet);
+    }
+  }
+
+  av_write_trailer(oc);
+
+  av_frame_free(&frame);
+  avcodec_close(enc);
+  avio_closep(&oc->pb);
+  avformat_free_context(oc);
+
+  return true;
+}
+
+
+// --- benchmarks ---
+
+void benchDecoder(const char* filename)
+{
+  printf("\n--- %s ---\n", filename);
+
+  Decoder decoder;
+  if (decoder.loadMovie(filename) != 0) {
+    fprintf(stderr, "cannot load %s\n", filename);
+    return;
+  }
+
+  int64_t nFrames = decoder.getNFrames();
+
+  measure("loadMovie (scanStream)", 1, [&]() {
+      Decoder d;
+      d.loadMovie(filename);
+    }, nFrames);
+
+
+  // seek patterns
+
+  const int nSeeks = 16;
+
+  measure("seekToFrame: sequential +1", nSeeks, [&]() {
+      decoder.seekToFrame(nFrames/2);
+      for (int i=1;i<=nSeeks;i++) decoder.seekToFrame(nFrames/2 + i);
+    }, 1);
+
+  measure("seekToFrame: short forward +10", nSeeks, [&]() {
+      decoder.seekToFrame(0);
+      for (int i=1;i<=nSeeks;i++) decoder.seekToFrame(std::min<int64_t>(i*10, nFrames-1));
+    });
+
+  measure("seekToFrame: sorted candidates", nSeeks, [&]() {
+      for (int i=0;i<nSeeks;i++) decoder.seekToFrame((i+1)*nFrames/(nSeeks+1));
+    });
+
+  std::vector<int64_t> randomFrames;
+  srand(1);
+  for (int i=0;i<nSeeks;i++) randomFrames.push_back(rand() % nFrames);
+
+  measure("seekToFrame: random access", nSeeks, [&]() {
+      for (int64_t f : randomFrames) decoder.seekToFrame(f);
+    });
+
+  measure("seekToFrame: backwards -1", nSeeks, [&]() {
+      decoder.seekToFrame(nFrames-1);
+      for (int i=1;i<=nSeeks;i++) decoder.seekToFrame(nFrames-1-i, Decoder::Backwards);
+    });
+
+
+  // features
+
+  decoder.seekToFrame(nFrames/2);
+  const AVFrame* frame = decoder.getVideoFrame();
+
+  const int nFeatureOps = 20;
+
+  measure("calcHistogram", nFeatureOps, [&]() {
+      for (int i=0;i<nFeatureOps;i++) calcHistogram(frame);
+    });
+
+  CropRect noCrop;
+  measure("convertToImage", nFeatureOps, [&]() {
+      for (int i=0;i<nFeatureOps;i++) convertToImage(frame, noCrop);
+    });
+}
+
+
+cvalgo::Histogram randomHistogram()
+{
+  cvalgo::Histogram h;
+  h.Create(0,255);
+
+  int peak = rand() % 256;
+  for (int i=0;i<256;i++) {
+    h.Count(i, 1.0 / (1 + abs(i-peak)) + (rand() % 100) / 1000.0);
+  }
+
+  h.Divide(h.TotalSum());
+  return h;
+}
+
+
+void benchHistogramDiff()
+{
+  printf("\n--- histogram metrics ---\n");
+
+  cvalgo::Histogram a = randomHistogram();
+  cvalgo::Histogram b = randomHistogram();
+
+  cvalgo::HistogramDiff_SquaredError        squared;
+  cvalgo::HistogramDiff_AbsoluteError       absolute;
+  cvalgo::HistogramDiff_ChiSquare           chiSquare;
+  cvalgo::HistogramDiff_KolmogorovSmirnov   ks;
+  cvalgo::HistogramDiff_EarthmoverDistance  emd;
+
+  cvalgo::HistogramDiff* metrics[] = { &squared, &absolute, &chiSquare, &ks, &emd };
+
+  const int nOps = 10000;
+
+  for (cvalgo::HistogramDiff* metric : metrics) {
+    std::string name = std::string("HistogramDiff: ") + metric->Name();
+    name.erase(std::remove(name.begin(), name.end(), '\n'), name.end());
+
+    volatile double sink;
+    measure(name.c_str(), nOps, [&]() {
+        for (int i=0;i<nOps;i++) sink = metric->Diff(a,b);
+      });
+  }
+}
+
+
+void benchSelection()
+{
+  printf("\n--- selection ---\n");
+
+  srand(1);
+
+  for (int nCandidates : { 16, 64, 256, 1024, 4096 }) {
+    std::vector<Candidate> pool;
+    for (int i=0;i<nCandidates;i++) {
+      Candidate c;
+      c.frameNr = i;
+      c.histogram = randomHistogram();
+      c.entropy = calcEntropy(c.histogram);
+      pool.push_back(c);
+    }
+
+    char name[100];
+    sprintf(name, "selectKeyframes: %d candidates", nCandidates);
+
+    measure(name, 1, [&]() {
+        std::vector<Candidate> candidates = pool;
+        std::vector<Candidate> keyframes;
+        selectKeyframes(candidates, keyframes);
+      });
+
+    sprintf(name, "clusterKeyframes: %d candidates", nCandidates);
+
+    measure(name, 1, [&]() {
+        std::vector<Candidate> candidates = pool;
+        std::vector<Candidate> keyframes;
+        clusterKeyframes(candidates, keyframes, 8, 0, 1);
+      });
+  }
+}
+
+
+int main(int argc, char** argv)
+{
+  av_register_all();
+
+  std::vector<std::string> videos;
+
+  if (argc > 1) {
+    for (int i=1;i<argc;i++) videos.push_back(argv[i]);
+  }
+  else {
+    const char* tmpdir = getenv("TMPDIR");
+    if (!tmpdir) tmpdir = "/tmp";
+
+    struct { int w,h,nFrames,gop; } configs[] = {
+      {  640, 360, 500, 25 },
+      { 1280, 720, 500, 250 }
+    };
+
+    for (auto& cfg : configs) {
+      char name[1000];
+      sprintf(name, "%s/extractor_bench_%dx%d_gop%d.mp4", tmpdir, cfg.w, cfg.h, cfg.gop);
+
+      if (access(name, R_OK) != 0) {
+        printf("generating %s\n", name);
+        if (!generateVideo(name, cfg.w, cfg.h, cfg.nFrames, cfg.gop)) {
+          fprintf(stderr, "cannot generate test video %s\n", name);
+          return 1;
+        }
+      }
+
+      videos.push_back(name);
+    }
+  }
+
+  for (const std::string& video : videos) {
+    benchDecoder(video.c_str());
+  }
+
+  benchHistogramDiff();
+  benchSelection();
+
+  return 0;
+}
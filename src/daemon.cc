@@ -0,0 +1,546 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "daemon.hh"
+#include "json.hh"
+#include "featurestore.hh"
+
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include <map>
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+}
+
+
+// --- client connection ---
+
+class Connection
+{
+public:
+  Connection(int inFd, int outFd, bool ownsFds)
+    : mIn(inFd), mOut(outFd), mOwnsFds(ownsFds) { }
+
+  ~Connection()
+  {
+    if (mOwnsFds) {
+      ::close(mIn);
+      if (mOut != mIn) ::close(mOut);
+    }
+  }
+
+  int inputFd() const { return mIn; }
+
+  // Send one line. Safe to call from several worker threads.
+  void send(const std::string& line)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    std::string data = line + "\n";
+    size_t written = 0;
+    while (written < data.size()) {
+      ssize_t n = write(mOut, data.data()+written, data.size()-written);
+      if (n<=0) return; // client is gone
+      written += n;
+    }
+  }
+
+private:
+  int mIn, mOut;
+  bool mOwnsFds;
+  std::mutex mMutex;
+};
+
+
+// --- jobs ---
+
+struct Job
+{
+  std::string id;
+  int priority;
+  uint64_t sequenceNr;
+
+  std::string input;
+  std::string output;
+  KeyframeOptions options;
+  bool stats;
+
+  double submitTime;
+
+  std::shared_ptr<Connection> connection;
+};
+
+
+struct JobOrder
+{
+  bool operator()(const Job& a, const Job& b) const
+  {
+    if (a.priority != b.priority) return a.priority < b.priority;
+    return a.sequenceNr > b.sequenceNr;
+  }
+};
+
+
+class JobQueue
+{
+public:
+  JobQueue(int maxSize) : mMaxSize(maxSize), mClosed(false), mNextSequenceNr(0) { }
+
+  // Returns false if the queue is full.
+  bool push(Job& job)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (mMaxSize > 0 && (int)mQueue.size() >= mMaxSize) {
+      return false;
+    }
+
+    job.sequenceNr = mNextSequenceNr++;
+    mQueue.push(job);
+    mCond.notify_one();
+    return true;
+  }
+
+  // Blocks until a job is available. Returns false when the queue was closed and is empty.
+  bool pop(Job& job)
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (mQueue.empty() && !mClosed) {
+      mCond.wait(lock);
+    }
+
+    if (mQueue.empty()) {
+      return false;
+    }
+
+    job = mQueue.top();
+    mQueue.pop();
+    return true;
+  }
+
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mClosed = true;
+    mCond.notify_all();
+  }
+
+private:
+  std::priority_queue<Job, std::vector<Job>, JobOrder> mQueue;
+  int  mMaxSize;
+  bool mClosed;
+  uint64_t mNextSequenceNr;
+
+  std::mutex mMutex;
+  std::condition_variable mCond;
+};
+
+
+static bool parseBool(const std::string& value)
+{
+  return value=="true" || value=="1";
+}
+
+
+static bool parseJob(const std::map<std::string,std::string>& fields,
+                     const DaemonConfig& config, Job& job, std::string& error)
+{
+  job.priority = 0;
+  job.options = config.defaults;
+  job.options.verbose = false; // stdout may be our reply channel
+  job.stats = false;
+
+  for (const auto& field : fields) {
+    const std::string& key   = field.first;
+    const std::string& value = field.second;
+
+    if      (key=="id")            { job.id = value; }
+    else if (key=="input")         { job.input = value; }
+    else if (key=="output")        { job.output = value; }
+    else if (key=="priority")      { job.priority = atoi(value.c_str()); }
+    else if (key=="number")        { job.options.number = atoi(value.c_str()); }
+    else if (key=="candidates")    { job.options.candidates = atoi(value.c_str()); }
+    else if (key=="budget")        { job.options.decodeBudget = atoi(value.c_str()); }
+    else if (key=="random")        { job.options.sampler = parseBool(value) ? Sampler_Stratified : Sampler_Uniform; }
+    else if (key=="seed")          { job.options.randomSeed = strtoull(value.c_str(), NULL, 10); }
+    else if (key=="sampler") {
+      if (!parseSamplerType(value.c_str(), job.options.sampler)) {
+        error = "invalid sampler";
+        return false;
+      }
+    }
+    else if (key=="noseek")        { job.options.noseek = parseBool(value); }
+    else if (key=="pipeline")      { job.options.pipeline = parseBool(value); }
+    else if (key=="prefetch")      { job.options.prefetch = atoi(value.c_str()); }
+    else if (key=="seek_mode") {
+      if      (value=="pts")  { job.options.seekMode = Decoder::Seek_Timestamp; }
+      else if (value=="byte") { job.options.seekMode = Decoder::Seek_Byte; }
+      else if (value=="auto") { job.options.seekMode = Decoder::Seek_Auto; }
+      else {
+        error = "invalid seek_mode";
+        return false;
+      }
+    }
+    else if (key=="decoder") {
+      if      (value=="libavcodec") { job.options.decoderBackend = Decoder::Backend_LibAVCodec; }
+      else if (value=="libde265")   { job.options.decoderBackend = Decoder::Backend_LibDE265; }
+      else if (value=="auto")       { job.options.decoderBackend = Decoder::Backend_Auto; }
+      else {
+        error = "invalid decoder";
+        return false;
+      }
+    }
+    else if (key=="memory_limit") {
+      if (!parseByteSize(value.c_str(), job.options.memoryLimit)) {
+        error = "invalid memory_limit";
+        return false;
+      }
+    }
+    else if (key=="memory_policy") {
+      if      (value=="drop")  { job.options.memoryPolicy = KeyframeOptions::Memory_Drop; }
+      else if (value=="spill") { job.options.memoryPolicy = KeyframeOptions::Memory_Spill; }
+      else {
+        error = "invalid memory_policy";
+        return false;
+      }
+    }
+    else if (key=="selection") {
+      if      (value=="greedy")  { job.options.selection = KeyframeOptions::Selection_Greedy; }
+      else if (value=="cluster") { job.options.selection = KeyframeOptions::Selection_Cluster; }
+      else {
+        error = "invalid selection";
+        return false;
+      }
+    }
+    else if (key=="deadline")      { job.options.deadline = atof(value.c_str()); }
+    else if (key=="keep_blank")    { job.options.rejectBlank = !parseBool(value); }
+    else if (key=="border_crop_v") { job.options.borderCropV = parseBool(value); }
+    else if (key=="border_crop_h") { job.options.borderCropH = parseBool(value); }
+    else if (key=="stats")         { job.stats = parseBool(value); }
+    else if (key=="features")      { job.options.featureStore = value; }
+    else if (key=="index_cache")   { job.options.indexCache = value; }
+    else if (key=="probesize")     { job.options.probeSize = strtoll(value.c_str(), NULL, 10); }
+    else if (key=="analyzeduration") { job.options.analyzeDuration = atof(value.c_str()); }
+    else if (key=="start" || key=="end") {
+      if (!parsePosition(value.c_str(), key=="start" ? job.options.rangeStart : job.options.rangeEnd)) {
+        error = "invalid " + key + " position";
+        return false;
+      }
+    }
+    else if (key=="aspect_crop") {
+      if (!parseAspect(value.c_str(), job.options.aspectH, job.options.aspectV)) {
+        error = "invalid aspect_crop";
+        return false;
+      }
+    }
+    else {
+      error = "unknown key: " + key;
+      return false;
+    }
+  }
+
+  if (job.input.empty()) {
+    error = "missing input";
+    return false;
+  }
+
+  // concurrent jobs would overwrite each other's files with a shared default
+
+  if (job.output.empty()) {
+    error = "missing output";
+    return false;
+  }
+
+  if (!isValidOutputPattern(job.output.c_str())) {
+    error = "invalid output pattern (needs exactly one integer conversion, like %02d)";
+    return false;
+  }
+
+  if (job.options.featureStore == "auto") {
+    job.options.featureStore = defaultFeatureStorePath(job.input.c_str());
+  }
+
+  if (job.options.indexCache == "auto") {
+    job.options.indexCache = Decoder::defaultIndexCachePath(job.input.c_str());
+  }
+
+  if (job.options.number <= 0) {
+    error = "number must be > 0";
+    return false;
+  }
+
+  return true;
+}
+
+
+static void sendError(Connection& connection, const std::string& id, const std::string& error)
+{
+  connection.send("{\"id\": " + jsonString(id) +
+                  ", \"status\": \"error\", \"error\": " + jsonString(error) + "}");
+}
+
+
+// --- workers ---
+
+static void worker(JobQueue* queue)
+{
+  KeyframeExtractor extractor;
+  std::vector<Keyframe> keyframes;
+
+  Job job;
+  while (queue->pop(job)) {
+    double startTime = wallClockSeconds();
+
+    Statistics stats;
+    job.options.stats = (job.stats ? &stats : NULL);
+
+    int err = extractor.extract(job.input.c_str(), job.options, keyframes);
+    if (err) {
+      sendError(*job.connection, job.id, "cannot load video " + job.input);
+      continue;
+    }
+
+    std::vector<std::string> filenames;
+    if (!writeKeyframeFiles(keyframes, job.output.c_str(), &filenames)) {
+      sendError(*job.connection, job.id, "cannot write output files");
+      continue;
+    }
+
+    double endTime = wallClockSeconds();
+
+    char buf[200];
+    std::string reply = "{\"id\": " + jsonString(job.id) + ", \"status\": \"ok\"";
+    reply += ", \"input\": " + jsonString(job.input);
+
+    sprintf(buf, ", \"queue_time\": %.6f, \"processing_time\": %.6f, \"latency\": %.6f",
+            startTime - job.submitTime, endTime - startTime, endTime - job.submitTime);
+    reply += buf;
+
+    reply += ", \"keyframes\": [";
+    for (size_t i=0;i<keyframes.size();i++) {
+      const Keyframe& k = keyframes[i];
+
+      sprintf(buf, "%s{\"file\": ", i>0 ? ", " : "");
+      reply += buf + jsonString(filenames[i]);
+
+      sprintf(buf, ", \"frame_number\": %lld, \"pts\": %lld, \"timestamp\": %f, \"score\": %f}",
+              (long long)k.frameNr, (long long)k.pts, k.timestamp, k.score);
+      reply += buf;
+    }
+    reply += "]";
+
+    sprintf(buf, ", \"evaluated_candidates\": %d, \"deadline_reached\": %s",
+            extractor.getNumEvaluatedCandidates(),
+            extractor.wasDeadlineReached() ? "true" : "false");
+    reply += buf;
+
+    sprintf(buf, ", \"open_time\": %.6f, \"index_cached\": %s",
+            extractor.getOpenTime(), extractor.usedIndexCache() ? "true" : "false");
+    reply += buf;
+
+    if (job.stats) {
+      reply += ", \"stats\": " + stats.toJSON(job.input);
+    }
+
+    reply += "}";
+
+    job.connection->send(reply);
+
+    keyframes.clear(); // release the frames, keep the vector
+  }
+}
+
+
+// --- input ---
+
+static void readJobs(std::shared_ptr<Connection> connection, FILE* in,
+                     JobQueue* queue, const DaemonConfig* config)
+{
+  char* line = NULL;
+  size_t lineSize = 0;
+
+  while (getline(&line, &lineSize, in) >= 0) {
+    std::string text = line;
+    if (text.find_first_not_of(" \t\r\n") == std::string::npos) {
+      continue;
+    }
+
+    std::map<std::string,std::string> fields;
+    std::string error;
+
+    if (!parseJSONObject(text, fields, error)) {
+      sendError(*connection, "", "invalid JSON: " + error);
+      continue;
+    }
+
+    Job job;
+    if (!parseJob(fields, *config, job, error)) {
+      sendError(*connection, fields["id"], error);
+      continue;
+    }
+
+    job.connection = connection;
+    job.submitTime = wallClockSeconds();
+
+    if (!queue->push(job)) {
+      sendError(*connection, job.id, "job queue is full");
+    }
+  }
+
+  free(line);
+}
+
+
+static void readJobsFromSocket(std::shared_ptr<Connection> connection,
+                               JobQueue* queue, const DaemonConfig* config)
+{
+  FILE* in = fdopen(dup(connection->inputFd()), "r");
+  if (in) {
+    readJobs(connection, in, queue, config);
+    fclose(in);
+  }
+}
+
+
+// libavcodec requires a lock manager when codecs are opened from several threads
+
+static int lockManager(void** mutex, enum AVLockOp op)
+{
+  switch (op) {
+  case AV_LOCK_CREATE:  *mutex = new std::mutex; break;
+  case AV_LOCK_OBTAIN:  static_cast<std::mutex*>(*mutex)->lock(); break;
+  case AV_LOCK_RELEASE: static_cast<std::mutex*>(*mutex)->unlock(); break;
+  case AV_LOCK_DESTROY: delete static_cast<std::mutex*>(*mutex); break;
+  }
+
+  return 0;
+}
+
+
+// Listening unix domain socket at 'path', or -1 on error.
+static int openSocket(const std::string& path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (path.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path.c_str());
+    return -1;
+  }
+
+  strcpy(addr.sun_path, path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd<0) {
+    perror("socket");
+    return -1;
+  }
+
+  unlink(path.c_str());
+
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 16) < 0) {
+    perror(path.c_str());
+    ::close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+
+int runDaemon(const DaemonConfig& config)
+{
+  av_lockmgr_register(lockManager);
+  signal(SIGPIPE, SIG_IGN);
+
+  // the socket is set up before the workers start, such that errors can return directly
+
+  int fd = -1;
+  if (!config.socketPath.empty()) {
+    fd = openSocket(config.socketPath);
+    if (fd<0) {
+      return 1;
+    }
+  }
+
+  JobQueue queue(config.maxQueue);
+
+  std::vector<std::thread> workers;
+  for (int i=0;i<std::max(config.nWorkers,1);i++) {
+    workers.push_back(std::thread(worker, &queue));
+  }
+
+
+  if (fd<0) {
+
+    // --- stdin / stdout: run until end of input and all jobs are finished ---
+
+    std::shared_ptr<Connection> connection(new Connection(0,1,false));
+    readJobs(connection, stdin, &queue, &config);
+
+    queue.close();
+    for (auto& t : workers) {
+      t.join();
+    }
+
+    return 0;
+  }
+
+
+  // --- unix domain socket: one reader thread per client connection ---
+
+  for (;;) {
+    int client = accept(fd, NULL, NULL);
+    if (client<0) {
+      if (errno==EINTR) continue;
+      perror("accept");
+      break;
+    }
+
+    std::shared_ptr<Connection> connection(new Connection(client,client,true));
+    std::thread(readJobsFromSocket, connection, &queue, &config).detach();
+  }
+
+  ::close(fd);
+
+  queue.close();
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  return 1;
+}
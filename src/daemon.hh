@@ -0,0 +1,58 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DAEMON_HH
+#define DAEMON_HH
+
+#include "keyframe.hh"
+#include <string>
+
+
+/* Daemon mode: jobs are submitted as JSON lines, one object per job, e.g.
+
+     {"id": "42", "input": "video.mp4", "output": "/tmp/kf42_%02d.jpg", "priority": 5}
+
+   "input" and "output" (a printf pattern with one integer conversion) are required.
+   Further keys override the command line defaults: number, candidates, budget, random,
+   sampler, seed, noseek, pipeline, prefetch, seek_mode, decoder, memory_limit,
+   memory_policy, selection, deadline, keep_blank, start, end, border_crop_v,
+   border_crop_h, aspect_crop, stats, features, index_cache, probesize, analyzeduration.
+
+   One JSON line is sent back per job, when it is finished. It contains the
+   written files, the frame metadata and the queue/processing latency.
+
+   A fixed number of worker threads process the jobs in priority order (higher
+   first, FIFO for equal priority). Each worker keeps its extractor (decoder,
+   scaler, JPEG encoder and scratch buffers) between jobs.
+ */
+
+struct DaemonConfig
+{
+  std::string socketPath;     // empty: read jobs from stdin, reply on stdout
+  int nWorkers;
+  int maxQueue;               // 0: unlimited
+
+  KeyframeOptions defaults;
+};
+
+
+int runDaemon(const DaemonConfig&);
+
+#endif
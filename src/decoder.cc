@@ -19,28 +19,171 @@
  */
 
 #include "decoder.hh"
+#include "decoderbackend.hh"
+extern "C" {
+#include "libavutil/opt.h"
+}
 #include <iostream>
 #include <algorithm>
+#include <map>
+#include <set>
+#include <memory>
+#include <thread>
+#include <functional>
+#include <atomic>
+#include "queue.hh"
 #include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 const bool D = false;
 
 
+// --- prefetching ---
+
+struct PrefetchedFrame
+{
+  int64_t  frameNr;
+  AVFrame* frame;  // NULL if it could not be decoded
+};
+
+
+class Decoder::Prefetcher
+{
+public:
+  Prefetcher(int bufferSize) : buffer(bufferSize), stop(false), haveNext(false) { }
+
+  Decoder decoder;  // opened with openCopy()
+  std::vector<int64_t> frames;
+
+  BoundedQueue<PrefetchedFrame> buffer;
+  std::atomic<bool> stop;
+  std::thread thread;
+
+  PrefetchedFrame next;  // taken from the buffer, but not yet requested
+  bool haveNext;
+
+  void run();
+
+private:
+  static const int HintAheadFrames = 4;  // targets for which the GOPs are hinted in advance
+
+  void hint(size_t targetIdx);
+};
+
+
+void Decoder::Prefetcher::hint(size_t targetIdx)
+{
+  const std::vector<int64_t>& keys = decoder.mKeyframes;
+
+  auto k = std::upper_bound(keys.begin(), keys.end(), frames[targetIdx]);
+  if (k == keys.begin()) {
+    return;
+  }
+
+  // byte range of the GOP: from its keyframe up to the next keyframe with known position
+
+  int64_t start = decoder.mFrameInfos[*(k-1)].pos;
+
+  for ( ; k != keys.end(); ++k) {
+    int64_t end = decoder.mFrameInfos[*k].pos;
+    if (end > start) {
+      if (start >= 0) {
+        decoder.mInput.willNeed(start, end-start);
+      }
+      return;
+    }
+  }
+}
+
+
+void Decoder::Prefetcher::run()
+{
+  // the first targets are hinted before decoding starts, further ones one by one
+
+  for (size_t i=0; i<frames.size() && i<HintAheadFrames; i++) {
+    hint(i);
+  }
+
+  for (size_t i=0; i<frames.size() && !stop; i++) {
+    if (i+HintAheadFrames < frames.size()) {
+      hint(i+HintAheadFrames);
+    }
+
+    PrefetchedFrame p;
+    p.frameNr = frames[i];
+    p.frame = NULL;
+
+    if (decoder.seekToFrame(p.frameNr)==0 && decoder.getCurrentFrameNr()==p.frameNr) {
+      p.frame = av_frame_clone(decoder.getVideoFrame());
+    }
+
+    buffer.push(p); // waits while the buffer is full
+  }
+
+  buffer.close();
+}
+
+
 Decoder::Decoder()
 {
   av_register_all();
 
   //mState = STATE_CLOSED;
   mFormatCtx = NULL;
+  mVDecoder.mDecoder = NULL;
+  mBackendType = Backend_Auto;
+  mBackendThreads = 0;
 
   mCurrentFrame = NULL;
   mCurrentFrameNumber = -1;
+  mDecodedFrameNumber = -1;
+  mFrameCacheSize = DefaultFrameCacheSize;
+  mClosedGOPs = false;
+  mSeekMode = Seek_Auto;
+  mByteSeek = false;
+  mRangeBeginFrame = 0;
+  mRangeEndFrame = 0;
+
+  mStats = NULL;
+  mIOMode = FileInput::IO_Read;
+
+  mProbeSize = 0;
+  mAnalyzeDuration = 0;
+  mUsedIndexCache = false;
+  mOpenTime = 0;
 }
 
 
 Decoder::~Decoder()
 {
+  close();
+}
+
+
+void Decoder::close()
+{
+  stopPrefetch();
   freeCurrentFrame();
+  clearFrameCache();
+  mFrameInfos.clear();
+  mKeyframes.clear();
+  mClosedGOPs = false;
+  mByteSeek = false;
+  mCurrentFrameNumber = -1;
+  mDecodedFrameNumber = -1;
+  mRangeBeginFrame = 0;
+  mRangeEndFrame = 0;
+
+  if (mFormatCtx) {
+    mBackend.reset(); // closes the codec context of the stream
+    mVDecoder.mDecoder = NULL;
+
+    avformat_close_input(&mFormatCtx);
+  }
+
+  mInput.close();
 }
 
 void Decoder::freeCurrentFrame()
@@ -53,6 +196,73 @@ void Decoder::freeCurrentFrame()
   }
 }
 
+void Decoder::setFrameCacheSize(int nFrames)
+{
+  mFrameCacheSize = nFrames;
+
+  while (mFrameCache.size() > std::max(mFrameCacheSize,0)) {
+    av_frame_free(&mFrameCache.front().frame);
+    mFrameCache.erase(mFrameCache.begin());
+  }
+}
+
+
+void Decoder::cacheFrame(int64_t frameNr, const AVFrame* frame)
+{
+  if (mFrameCacheSize<=0 || frameNr<0) {
+    return;
+  }
+
+  for (const auto& c : mFrameCache) {
+    if (c.frameNr == frameNr) return;
+  }
+
+  if (mFrameCache.size() >= mFrameCacheSize) {
+    av_frame_free(&mFrameCache.front().frame);
+    mFrameCache.erase(mFrameCache.begin());
+  }
+
+  cachedframe c;
+  c.frameNr = frameNr;
+  c.frame = av_frame_clone(frame);
+  mFrameCache.push_back(c);
+}
+
+
+bool Decoder::loadCachedFrame(int64_t frameNr)
+{
+  for (size_t i=0;i<mFrameCache.size();i++) {
+    if (mFrameCache[i].frameNr == frameNr) {
+      cachedframe c = mFrameCache[i];
+
+      // move to the end (most recently used)
+
+      mFrameCache.erase(mFrameCache.begin()+i);
+      mFrameCache.push_back(c);
+
+      freeCurrentFrame();
+      mCurrentFrame = av_frame_clone(c.frame);
+      mCurrentFrameNumber = frameNr;
+
+      if (mStats) mStats->count(Statistics::Counter_FrameCacheHits);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void Decoder::clearFrameCache()
+{
+  for (auto& c : mFrameCache) {
+    av_frame_free(&c.frame);
+  }
+
+  mFrameCache.clear();
+}
+
+
 int64_t Decoder::getVideoDuration() const
 {
   assert(mFormatCtx);
@@ -60,22 +270,94 @@ int64_t Decoder::getVideoDuration() const
 }
 
 
+int64_t Decoder::getBytesRead() const
+{
+  if (mInput.isOpen()) {
+    return mInput.getBytesRead();
+  }
+
+  if (mFormatCtx && mFormatCtx->pb) {
+    return mFormatCtx->pb->bytes_read;
+  }
+
+  return 0;
+}
+
+
+// libavformat's default probe limits
+static const int64_t DefaultProbeSize = 5000000;
+static const int64_t DefaultAnalyzeDuration = 5*AV_TIME_BASE;
+
+static bool hasVideoParameters(const AVFormatContext* formatCtx)
+{
+  for (int i=0;i<formatCtx->nb_streams;i++) {
+    const AVCodecContext* ctx = formatCtx->streams[i]->codec;
+
+    if (ctx->codec_type == AVMEDIA_TYPE_VIDEO &&
+        ctx->codec_id != AV_CODEC_ID_NONE &&
+        ctx->width > 0 && ctx->height > 0 &&
+        ctx->pix_fmt != AV_PIX_FMT_NONE) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
 int Decoder::loadMovie(const char* filename)
 {
-  freeCurrentFrame();
-  mFrameInfos.clear();
-  mCurrentFrameNumber = -1;
+  close();
 
-  int err;
-  if ((err=avformat_open_input(&mFormatCtx, filename, NULL, NULL)) < 0) {
-    return err;
+  double openStart = wallClockSeconds();
+  StageTimer openTimer(mStats, Statistics::Stage_Open);
+
+  mFormatCtx = avformat_alloc_context();
+
+  // use our own file input for regular files (otherwise libavformat's I/O)
+
+  if (mInput.open(filename, mIOMode)) {
+    mFormatCtx->pb = mInput.getAVIOContext();
+    mFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
   }
 
+  AVDictionary* formatOptions = NULL;
+  if (mProbeSize>0)       { av_dict_set_int(&formatOptions, "probesize", mProbeSize, 0); }
+  if (mAnalyzeDuration>0) { av_dict_set_int(&formatOptions, "analyzeduration", mAnalyzeDuration, 0); }
+
+  int err = avformat_open_input(&mFormatCtx, filename, NULL, &formatOptions);
+  av_dict_free(&formatOptions);
 
-  if ((err=avformat_find_stream_info(mFormatCtx, NULL)) <0 ) {
+  if (err < 0) {
+    mInput.close();
     return err;
   }
 
+
+  // stream parameters from the index cache, probing only if they are incomplete
+
+  cachedindex cache;
+  mUsedIndexCache = (!mIndexCacheFile.empty() &&
+                     readIndexCache(filename, cache) &&
+                     applyCachedStreamParameters(cache));
+
+  if (!mUsedIndexCache) {
+    if ((err=avformat_find_stream_info(mFormatCtx, NULL)) <0 ) {
+      return err;
+    }
+
+    // with probe limits, the parameters may be incomplete: probe again with the defaults
+
+    if ((mProbeSize>0 || mAnalyzeDuration>0) && !hasVideoParameters(mFormatCtx)) {
+      av_opt_set_int(mFormatCtx, "probesize", DefaultProbeSize, 0);
+      av_opt_set_int(mFormatCtx, "analyzeduration", DefaultAnalyzeDuration, 0);
+
+      if ((err=avformat_find_stream_info(mFormatCtx, NULL)) <0 ) {
+        return err;
+      }
+    }
+  }
+
   bool videoStreamFound=false;
   mVDecoder.mDecoder = NULL;
 
@@ -85,6 +367,10 @@ int Decoder::loadMovie(const char* filename)
 
     AVStream* stream = mFormatCtx->streams[i];
 
+    if (mUsedIndexCache && i != cache.streamIdx) {
+      continue;
+    }
+
     if (stream->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
       AVCodec* codec = avcodec_find_decoder(stream->codec->codec_id);
       if (codec != NULL) {
@@ -94,14 +380,12 @@ int Decoder::loadMovie(const char* filename)
 	mVDecoder.mStream = stream;
         mVDecoder.mStreamIdx = i;
 
-        stream->codec->refcounted_frames = 1;
-
-        if ((err = avcodec_open2(stream->codec, codec, NULL))<0) {
+        if ((err = openBackend(codec, stream->codec))<0) {
           return err;
         }
 
         if (D) {
-        std::cout << i << ": " << codec->long_name << "\n";
+        std::cout << i << ": " << codec->long_name << " (" << mBackend->name() << ")\n";
 	std::cout << "   time-base: " << stream->time_base.num << "/" << stream->time_base.den << "\n";
 	std::cout << "   duration:  " << stream->duration << " = "
 		  << stream->duration * stream->time_base.num / double(stream->time_base.den) << "\n";
@@ -119,7 +403,44 @@ int Decoder::loadMovie(const char* filename)
     return 1; // error: no video stream/decoder found
   }
 
-  scanStream();
+
+  // demuxer can skip all packets of other streams
+
+  for (int i=0;i<mFormatCtx->nb_streams;i++) {
+    if (i != mVDecoder.mStreamIdx) {
+      mFormatCtx->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+
+  openTimer.stop();
+
+
+  // byte seeking needs a seekable input with a usable file position in the packets
+
+  bool byteSeekable = !(mFormatCtx->iformat->flags & AVFMT_NO_BYTE_SEEK);
+
+  switch (mSeekMode) {
+  case Seek_Timestamp: mByteSeek = false; break;
+  case Seek_Byte:      mByteSeek = byteSeekable; break;
+  case Seek_Auto:      mByteSeek = byteSeekable && (mFormatCtx->iformat->flags & AVFMT_TS_DISCONT); break;
+  }
+
+  // frame index from the cache if it was made for the same range, otherwise scan
+
+  if (mUsedIndexCache &&
+      cache.rangeStart.unit == mRangeStart.unit && cache.rangeStart.value == mRangeStart.value &&
+      cache.rangeEnd.unit   == mRangeEnd.unit   && cache.rangeEnd.value   == mRangeEnd.value) {
+    mFrameInfos.swap(cache.frames);
+    mClosedGOPs = cache.closedGOPs;
+    finishIndex();
+  }
+  else {
+    scanStream();
+
+    if (!mIndexCacheFile.empty() && !writeIndexCache(filename)) {
+      fprintf(stderr, "cannot write index cache %s\n", mIndexCacheFile.c_str());
+    }
+  }
 
   mInputFileName = filename;
 
@@ -128,18 +449,97 @@ int Decoder::loadMovie(const char* filename)
 
   loadNextFrame();
 
+  mOpenTime = wallClockSeconds() - openStart;
+
   return 0;
 }
 
 
+static AVRational averageFrameRate(const AVStream* stream)
+{
+  AVRational fps = stream->avg_frame_rate;
+  if (fps.num==0 || fps.den==0) fps = stream->r_frame_rate;
+  if (fps.num==0 || fps.den==0) { fps.num=25; fps.den=1; }
+
+  return fps;
+}
+
+
+int64_t Decoder::positionToPTS(const Position& pos) const
+{
+  const AVStream* stream = mVDecoder.mStream;
+
+  int64_t startTime = stream->start_time;
+  if (startTime == AV_NOPTS_VALUE) startTime = 0;
+
+  double seconds = pos.value;
+  if (pos.unit == Position::Frames) {
+    AVRational fps = averageFrameRate(stream);
+    seconds = pos.value * fps.den / fps.num;
+  }
+
+  return startTime + int64_t(seconds * stream->time_base.den / stream->time_base.num);
+}
+
+
+int64_t Decoder::getIndexBase() const
+{
+  if (mRangeStart.unit == Position::Unset || mFrameInfos.empty()) {
+    return 0; // the index starts with the first frame
+  }
+
+  const AVStream* stream = mVDecoder.mStream;
+
+  int64_t startTime = stream->start_time;
+  if (startTime == AV_NOPTS_VALUE) startTime = 0;
+
+  AVRational fps = averageFrameRate(stream);
+  double seconds = PTS2Time(mFrameInfos[0].pts - startTime);
+
+  return std::max(int64_t(0), int64_t(seconds * fps.num / fps.den + 0.5));
+}
+
+
 void Decoder::scanStream()
 {
+  StageTimer timer(mStats, Statistics::Stage_Scan);
+
+  int64_t startPTS = AV_NOPTS_VALUE;
+  int64_t endPTS   = AV_NOPTS_VALUE;
+
+  if (mRangeStart.unit != Position::Unset) { startPTS = positionToPTS(mRangeStart); }
+  if (mRangeEnd.unit   != Position::Unset) { endPTS   = positionToPTS(mRangeEnd); }
+
+
+  // start indexing at the keyframe before the range start
+
+  if (startPTS != AV_NOPTS_VALUE) {
+    av_seek_frame(mFormatCtx, mVDecoder.mStreamIdx, startPTS, AVSEEK_FLAG_BACKWARD);
+  }
+
   AVPacket packet;
 
+  // A GOP is open if a frame following the keyframe in decoding order is displayed
+  // before it (it references the previous GOP). Without PTS, we cannot tell.
+
+  mClosedGOPs = true;
+  int64_t keyframePTS = AV_NOPTS_VALUE;
+
   int i=0;
   int err;
   while ((err=av_read_frame(mFormatCtx, &packet))==0)  // while OK
     {
+      if (mStats) mStats->count(Statistics::Counter_PacketsDemuxed);
+
+      // stop when we passed the range end (all further frames have PTS >= DTS > end)
+
+      if (packet.stream_index == mVDecoder.mStreamIdx &&
+          endPTS != AV_NOPTS_VALUE &&
+          packet.dts != AV_NOPTS_VALUE && packet.dts > endPTS) {
+        av_free_packet(&packet);
+        break;
+      }
+
       if (packet.stream_index == mVDecoder.mStreamIdx) {
 
 
@@ -152,6 +552,17 @@ void Decoder::scanStream()
         fi.dts = packet.dts;
 
 	fi.key = !!(packet.flags & AV_PKT_FLAG_KEY);
+        fi.pos = (fi.key ? packet.pos : -1);
+
+        if (packet.pts == AV_NOPTS_VALUE) {
+          mClosedGOPs = false;
+        }
+        else if (fi.key) {
+          keyframePTS = packet.pts;
+        }
+        else if (keyframePTS != AV_NOPTS_VALUE && packet.pts < keyframePTS) {
+          mClosedGOPs = false;
+        }
 
         if (D) printf("%d: pts:%ld dts:%ld %s\n",i++,
                packet.pts,packet.dts, fi.key ? "KEY":"");
@@ -167,6 +578,18 @@ void Decoder::scanStream()
       av_free_packet(&packet);
     }
 
+  finishIndex();
+}
+
+
+void Decoder::finishIndex()
+{
+  int64_t startPTS = AV_NOPTS_VALUE;
+  int64_t endPTS   = AV_NOPTS_VALUE;
+
+  if (mRangeStart.unit != Position::Unset) { startPTS = positionToPTS(mRangeStart); }
+  if (mRangeEnd.unit   != Position::Unset) { endPTS   = positionToPTS(mRangeEnd); }
+
 
   // sort images in temporal order (PTS)
 
@@ -174,99 +597,367 @@ void Decoder::scanStream()
             [](const Decoder::frameinfo& a,const Decoder::frameinfo& b) { return a.pts<b.pts; });
 
 
-  // seek to beginning
-
-  err = av_seek_frame(mFormatCtx, mVDecoder.mStreamIdx,
-		      mVDecoder.mStream->start_time, AVSEEK_FLAG_BACKWARD);
+  for (int64_t f=0;f<mFrameInfos.size();f++) {
+    if (mFrameInfos[f].key) {
+      mKeyframes.push_back(f);
+    }
+  }
 
-  avcodec_flush_buffers(mVDecoder.mDecoderContext);
-}
 
+  // frames within the requested range
 
-AVFrame* Decoder::getVideoFrame()
-{
-  assert(mCurrentFrame);
-  return mCurrentFrame;
-}
+  mRangeBeginFrame = 0;
+  mRangeEndFrame = mFrameInfos.size();
 
+  if (startPTS != AV_NOPTS_VALUE) {
+    while (mRangeBeginFrame < mRangeEndFrame &&
+           mFrameInfos[mRangeBeginFrame].pts < startPTS) {
+      mRangeBeginFrame++;
+    }
+  }
 
-int Decoder::loadNextFrame()
-{
-  if (mCurrentFrame) {
-    freeCurrentFrame();
+  if (endPTS != AV_NOPTS_VALUE) {
+    while (mRangeEndFrame > mRangeBeginFrame &&
+           mFrameInfos[mRangeEndFrame-1].pts > endPTS) {
+      mRangeEndFrame--;
+    }
   }
 
 
-  AVFrame* frame = av_frame_alloc();
-  int got_picture = 0;
+  // seek to beginning
 
-  int err = read_video_frame(frame, &got_picture);
+  av_seek_frame(mFormatCtx, mVDecoder.mStreamIdx,
+                startPTS != AV_NOPTS_VALUE ? startPTS : mVDecoder.mStream->start_time,
+                AVSEEK_FLAG_BACKWARD);
 
-  if (got_picture) {
+  mBackend->flush();
+}
 
-    mCurrentFrame = frame;
 
+// --- index cache ---
 
-    // advance current frame number
+/* File layout: header, codec extradata, then one record per frame
+   (int64_t pts, dts, pos, key). Integers in host byte order.
+ */
 
-    if (mCurrentFrameNumber<0) {
-      mCurrentFrameNumber=0;
-    }
-    else {
-      mCurrentFrameNumber++;
-    }
+static const char IndexCacheMagic[8] = { 'K','F','I','N','D','E','X','1' };
 
+struct IndexCacheHeader
+{
+  char     magic[8];
+  int64_t  videoSize;
+  int64_t  videoMTime;
 
-    // check that the decoded frame PTS matches the stored PTS
+  int32_t  streamIdx;
+  int32_t  codecId, width, height, pixFmt;
+  int32_t  timeBase[2], avgFrameRate[2], rFrameRate[2];
+  int64_t  startTime, streamDuration, formatDuration;
+  int32_t  extradataSize;
 
-    int64_t currentPTS = frame->pkt_pts;
-    if (D) printf("expected PTS[%d]=%ld, actual PTS:%ld\n",mCurrentFrameNumber,mFrameInfos[mCurrentFrameNumber].pts,currentPTS);
+  int32_t  rangeUnit[2];
+  double   rangeValue[2];
 
+  int32_t  closedGOPs;
+  int64_t  nFrames;
+};
 
-    // we did not return the expected frame -> adjust current frame number
 
-    if (mFrameInfos[mCurrentFrameNumber].pts != currentPTS) {
-      if (currentPTS > mFrameInfos[mCurrentFrameNumber].pts) // we skipped forward (should never happen. Maybe broken video file.)
-	{
-	}
+static bool videoFileInfo(const char* filename, int64_t& size, int64_t& mtime)
+{
+  struct stat st;
+  if (stat(filename, &st)<0) {
+    return false;
+  }
 
-      for (int f=mCurrentFrameNumber+1 ; f<mFrameInfos.size() ; f++) {
-        if (mFrameInfos[f].pts == currentPTS) {
-          mCurrentFrameNumber = f;
-          break;
-        }
-      }
+  size  = st.st_size;
+  mtime = st.st_mtime;
+  return true;
+}
 
-      // assert(currentPTS == mFrameInfos[mCurrentFrameNumber].pts); // should be correct now (but video file can be broken)
-    }
-  }
-  else {
-    av_free(frame);
-  }
 
-  return err;
+std::string Decoder::defaultIndexCachePath(const char* filename)
+{
+  return std::string(filename) + ".index";
 }
 
 
-int Decoder::read_video_frame(AVFrame* frame, int* got_picture)
+bool Decoder::readIndexCache(const char* videoFilename, cachedindex& cache) const
 {
-  AVPacket packet;
-  int err;
+  FILE* fh = fopen(mIndexCacheFile.c_str(), "rb");
+  if (fh==NULL) {
+    return false;
+  }
 
+  IndexCacheHeader h;
+  int64_t videoSize, videoMTime;
+
+  bool ok = (fread(&h, sizeof(h), 1, fh) == 1 &&
+             memcmp(h.magic, IndexCacheMagic, sizeof(IndexCacheMagic))==0 &&
+             videoFileInfo(videoFilename, videoSize, videoMTime) &&
+             h.videoSize == videoSize && h.videoMTime == videoMTime &&
+             h.extradataSize >= 0 && h.nFrames >= 0 &&
+             h.streamIdx >= 0 && h.streamIdx < mFormatCtx->nb_streams);
+
+  if (ok) {
+    cache.streamIdx = h.streamIdx;
+    cache.codecId = h.codecId;
+    cache.width   = h.width;
+    cache.height  = h.height;
+    cache.pixFmt  = h.pixFmt;
+    cache.timeBase.num     = h.timeBase[0];     cache.timeBase.den     = h.timeBase[1];
+    cache.avgFrameRate.num = h.avgFrameRate[0]; cache.avgFrameRate.den = h.avgFrameRate[1];
+    cache.rFrameRate.num   = h.rFrameRate[0];   cache.rFrameRate.den   = h.rFrameRate[1];
+    cache.startTime      = h.startTime;
+    cache.streamDuration = h.streamDuration;
+    cache.formatDuration = h.formatDuration;
+    cache.rangeStart.unit  = (Position::Unit)h.rangeUnit[0];
+    cache.rangeStart.value = h.rangeValue[0];
+    cache.rangeEnd.unit    = (Position::Unit)h.rangeUnit[1];
+    cache.rangeEnd.value   = h.rangeValue[1];
+    cache.closedGOPs = h.closedGOPs;
+
+    cache.extradata.resize(h.extradataSize);
+    ok = (h.extradataSize==0 || fread(cache.extradata.data(), h.extradataSize, 1, fh) == 1);
+  }
 
-  // get packet from container format and try to decode image
+  if (ok) {
+    std::vector<int64_t> records(h.nFrames*4);
+    ok = (h.nFrames==0 || fread(records.data(), records.size()*sizeof(int64_t), 1, fh) == 1);
 
-  while ((err=av_read_frame(mFormatCtx, &packet))==0)  // while OK
-    {
-      if (packet.stream_index == mVDecoder.mStreamIdx) {
+    cache.frames.resize(h.nFrames);
+    for (int64_t i=0; ok && i<h.nFrames; i++) {
+      cache.frames[i].pts = records[4*i+0];
+      cache.frames[i].dts = records[4*i+1];
+      cache.frames[i].pos = records[4*i+2];
+      cache.frames[i].key = records[4*i+3];
+    }
+  }
 
-        int ret = avcodec_decode_video2(mVDecoder.mDecoderContext,
-                                        frame, got_picture, &packet);
+  fclose(fh);
 
-        if (D) std::cout << " got:" << *got_picture << " " << frame->pkt_pts << "\n";
-      }
+  return ok;
+}
 
-      av_free_packet(&packet);
+
+bool Decoder::writeIndexCache(const char* videoFilename) const
+{
+  const AVStream* stream = mVDecoder.mStream;
+  const AVCodecContext* ctx = stream->codec;
+
+  IndexCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, IndexCacheMagic, sizeof(IndexCacheMagic));
+
+  if (!videoFileInfo(videoFilename, h.videoSize, h.videoMTime)) {
+    return false;
+  }
+
+  h.streamIdx = mVDecoder.mStreamIdx;
+  h.codecId = ctx->codec_id;
+  h.width   = ctx->width;
+  h.height  = ctx->height;
+  h.pixFmt  = ctx->pix_fmt;
+  h.timeBase[0]     = stream->time_base.num;      h.timeBase[1]     = stream->time_base.den;
+  h.avgFrameRate[0] = stream->avg_frame_rate.num; h.avgFrameRate[1] = stream->avg_frame_rate.den;
+  h.rFrameRate[0]   = stream->r_frame_rate.num;   h.rFrameRate[1]   = stream->r_frame_rate.den;
+  h.startTime      = stream->start_time;
+  h.streamDuration = stream->duration;
+  h.formatDuration = mFormatCtx->duration;
+  h.extradataSize  = (ctx->extradata ? ctx->extradata_size : 0);
+  h.rangeUnit[0] = mRangeStart.unit;  h.rangeValue[0] = mRangeStart.value;
+  h.rangeUnit[1] = mRangeEnd.unit;    h.rangeValue[1] = mRangeEnd.value;
+  h.closedGOPs = mClosedGOPs;
+  h.nFrames    = mFrameInfos.size();
+
+  std::vector<int64_t> records;
+  records.reserve(mFrameInfos.size()*4);
+  for (const frameinfo& fi : mFrameInfos) {
+    records.push_back(fi.pts);
+    records.push_back(fi.dts);
+    records.push_back(fi.pos);
+    records.push_back(fi.key);
+  }
+
+
+  // write to a temporary file and rename, such that readers never see a partial cache
+
+  std::string tmpName = mIndexCacheFile + ".tmp";
+
+  FILE* fh = fopen(tmpName.c_str(), "wb");
+  if (fh==NULL) {
+    return false;
+  }
+
+  bool ok = (fwrite(&h, sizeof(h), 1, fh) == 1);
+  ok = ok && (h.extradataSize==0 || fwrite(ctx->extradata, h.extradataSize, 1, fh) == 1);
+  ok = ok && (records.empty() || fwrite(records.data(), records.size()*sizeof(int64_t), 1, fh) == 1);
+
+  ok = (fclose(fh)==0) && ok;
+  ok = ok && (rename(tmpName.c_str(), mIndexCacheFile.c_str()) == 0);
+
+  if (!ok) {
+    unlink(tmpName.c_str());
+  }
+
+  return ok;
+}
+
+
+/* Fill in the stream parameters that the demuxer did not set from its headers.
+   Returns false if the cache does not match the stream or if parameters needed
+   for decoding are still missing, such that the stream has to be probed.
+ */
+bool Decoder::applyCachedStreamParameters(const cachedindex& cache)
+{
+  AVStream* stream = mFormatCtx->streams[cache.streamIdx];
+  AVCodecContext* ctx = stream->codec;
+
+  if (ctx->codec_type != AVMEDIA_TYPE_VIDEO ||
+      stream->time_base.num != cache.timeBase.num ||
+      stream->time_base.den != cache.timeBase.den) {
+    return false;
+  }
+
+  if (ctx->codec_id == AV_CODEC_ID_NONE) { ctx->codec_id = (enum AVCodecID)cache.codecId; }
+  if (ctx->codec_id != cache.codecId) {
+    return false;
+  }
+
+  if (ctx->width==0 || ctx->height==0) {
+    ctx->width  = cache.width;
+    ctx->height = cache.height;
+  }
+
+  if (ctx->pix_fmt == AV_PIX_FMT_NONE) { ctx->pix_fmt = (enum AVPixelFormat)cache.pixFmt; }
+
+  if (ctx->extradata_size==0 && !cache.extradata.empty()) {
+    ctx->extradata = (uint8_t*)av_mallocz(cache.extradata.size() + FF_INPUT_BUFFER_PADDING_SIZE);
+    memcpy(ctx->extradata, cache.extradata.data(), cache.extradata.size());
+    ctx->extradata_size = cache.extradata.size();
+  }
+
+  if (stream->avg_frame_rate.num==0) { stream->avg_frame_rate = cache.avgFrameRate; }
+  if (stream->r_frame_rate.num==0)   { stream->r_frame_rate   = cache.rFrameRate; }
+  if (stream->start_time == AV_NOPTS_VALUE) { stream->start_time = cache.startTime; }
+  if (stream->duration   == AV_NOPTS_VALUE) { stream->duration   = cache.streamDuration; }
+  if (mFormatCtx->duration == AV_NOPTS_VALUE) { mFormatCtx->duration = cache.formatDuration; }
+
+  return (ctx->codec_id != AV_CODEC_ID_NONE &&
+          ctx->width > 0 && ctx->height > 0 &&
+          ctx->pix_fmt != AV_PIX_FMT_NONE);
+}
+
+
+AVFrame* Decoder::getVideoFrame()
+{
+  assert(mCurrentFrame);
+  return mCurrentFrame;
+}
+
+
+int Decoder::loadNextFrame()
+{
+  // the index ends before the end of the file with a range end
+
+  if (mDecodedFrameNumber+1 >= (int64_t)mFrameInfos.size()) {
+    return AVERROR_EOF;
+  }
+
+  if (mCurrentFrame) {
+    freeCurrentFrame();
+  }
+
+
+  AVFrame* frame = av_frame_alloc();
+  int got_picture = 0;
+
+  int err = read_video_frame(frame, &got_picture);
+
+  // After reopening the input, frames before the range are read, too. Skip them.
+
+  while (got_picture && mDecodedFrameNumber<0 &&
+         frame->pkt_pts != AV_NOPTS_VALUE && frame->pkt_pts < mFrameInfos[0].pts) {
+    av_frame_unref(frame);
+    got_picture = 0;
+    err = read_video_frame(frame, &got_picture);
+  }
+
+  if (got_picture) {
+
+    mCurrentFrame = frame;
+
+
+    // advance decoded frame number
+
+    if (mDecodedFrameNumber<0) {
+      mDecodedFrameNumber=0;
+    }
+    else {
+      mDecodedFrameNumber++;
+    }
+
+
+    // check that the decoded frame PTS matches the stored PTS
+
+    int64_t currentPTS = frame->pkt_pts;
+    if (D) printf("expected PTS[%d]=%ld, actual PTS:%ld\n",mDecodedFrameNumber,mFrameInfos[mDecodedFrameNumber].pts,currentPTS);
+
+
+    // we did not return the expected frame -> adjust current frame number
+
+    if (mFrameInfos[mDecodedFrameNumber].pts != currentPTS) {
+      if (currentPTS > mFrameInfos[mDecodedFrameNumber].pts) // we skipped forward (should never happen. Maybe broken video file.)
+	{
+	}
+
+      for (int f=mDecodedFrameNumber+1 ; f<mFrameInfos.size() ; f++) {
+        if (mFrameInfos[f].pts == currentPTS) {
+          mDecodedFrameNumber = f;
+          break;
+        }
+      }
+
+      // assert(currentPTS == mFrameInfos[mDecodedFrameNumber].pts); // should be correct now (but video file can be broken)
+    }
+
+    mCurrentFrameNumber = mDecodedFrameNumber;
+    cacheFrame(mCurrentFrameNumber, frame);
+  }
+  else {
+    av_free(frame);
+  }
+
+  return err;
+}
+
+
+int Decoder::read_video_frame(AVFrame* frame, int* got_picture)
+{
+  AVPacket packet;
+  int err;
+
+
+  // get packet from container format and try to decode image
+
+  for (;;)
+    {
+      StageTimer demuxTimer(mStats, Statistics::Stage_Demux);
+      err=av_read_frame(mFormatCtx, &packet);
+      demuxTimer.stop();
+
+      if (err!=0) break;
+
+      if (mStats) mStats->count(Statistics::Counter_PacketsDemuxed);
+
+      if (packet.stream_index == mVDecoder.mStreamIdx) {
+        StageTimer decodeTimer(mStats, Statistics::Stage_Decode);
+
+        int ret = mBackend->decode(frame, got_picture, &packet);
+
+        if (D) std::cout << " got:" << *got_picture << " " << frame->pkt_pts << "\n";
+      }
+
+      av_free_packet(&packet);
 
       if (*got_picture)
         break;
@@ -277,13 +968,12 @@ int Decoder::read_video_frame(AVFrame* frame, int* got_picture)
   // the remaining pictures out of the decoder
 
   if (err!=0) {
-    AVPacket emptyPacket;
-    av_init_packet(&emptyPacket);
-    emptyPacket.data = NULL;
-    emptyPacket.size = 0;
-    emptyPacket.stream_index = mVDecoder.mStreamIdx;
-    int ret=avcodec_decode_video2(mVDecoder.mDecoderContext,
-                                  frame, got_picture, &emptyPacket);
+    StageTimer decodeTimer(mStats, Statistics::Stage_Decode);
+    int ret=mBackend->decode(frame, got_picture, NULL);
+  }
+
+  if (*got_picture && mStats) {
+    mStats->count(Statistics::Counter_FramesDecoded);
   }
 
   return 0;
@@ -292,12 +982,23 @@ int Decoder::read_video_frame(AVFrame* frame, int* got_picture)
 
 int Decoder::seekToNextVideoFrame()
 {
+  if (loadCachedFrame(mCurrentFrameNumber+1)) {
+    return 0;
+  }
+
+  // the codec is not at the current frame when that came from the cache
+
+  if (mDecodedFrameNumber != mCurrentFrameNumber &&
+      mCurrentFrameNumber+1 < mFrameInfos.size()) {
+    return seekToFrame(mCurrentFrameNumber+1, Forwards);
+  }
+
   return loadNextFrame();
 }
 
 int Decoder::seekToPrevVideoFrame()
 {
-  assert(mCurrentFrame>0);
+  assert(mCurrentFrame);
   return seekToFrame(mCurrentFrameNumber-1, Backwards);
 }
 
@@ -310,13 +1011,20 @@ int Decoder::seekToFrame(int64_t frameNr, Direction direction)
   assert(frameNr<mFrameInfos.size());
 
 
-  int nReadForward = frameNr - mCurrentFrameNumber;
-
   // case 1: no seek required
 
-  if (nReadForward==0) { return 0; }
+  if (frameNr == mCurrentFrameNumber && mCurrentFrame) { return 0; }
 
-  // case 2: seek forward, only a few frames -> decode without skip
+  // case 2: frame was decoded before and is still in the cache, or it was prefetched
+
+  if (loadCachedFrame(frameNr)) { return 0; }
+
+  if (mPrefetcher && takePrefetchedFrame(frameNr)) { return 0; }
+
+  // case 3: seek forward, only a few frames -> decode without skip
+  // (counted from the codec position, which may be behind the current frame)
+
+  int nReadForward = frameNr - mDecodedFrameNumber;
 
   const int nReadForwardThreshold = 20;
 
@@ -324,7 +1032,7 @@ int Decoder::seekToFrame(int64_t frameNr, Direction direction)
     int err;
 
     // do not read fixed amount of frames (nReadForward), because there may be skipped frames
-    while (mCurrentFrameNumber < frameNr) {
+    while (mDecodedFrameNumber < frameNr) {
       err = loadNextFrame();
       if (err != 0) return err;
     }
@@ -332,7 +1040,7 @@ int Decoder::seekToFrame(int64_t frameNr, Direction direction)
   }
 
 
-  // case 3: skip and read until we get a frame with matching PTS
+  // case 4: skip and read until we get a frame with matching PTS
 
   freeCurrentFrame();
 
@@ -362,35 +1070,26 @@ int Decoder::seekToFrame(int64_t frameNr, Direction direction)
 #endif
 
 #if 1
-  /* Find the corresponding DTS for the frame and skip to that timestamp.
-     (Skipping usually uses the DTS. This is also safer than the PTS, since
-     the DTS is always smaller/equal.)
-   */
-
   int64_t targetPTS = mFrameInfos[frameNr].pts;
-  int64_t targetDTS = mFrameInfos[frameNr].dts;
 
   if (D) printf("targetPTS=%ld direction=%s\n",targetPTS,(direction==Forwards) ? "Forwards" : (direction==Backwards) ? "Backwards" : "Exact");
 
+  StageTimer seekTimer(mStats, Statistics::Stage_Seek);
+  if (mStats) mStats->count(Statistics::Counter_Seeks);
 
-  if (0) {
-    int err = avformat_seek_file(mFormatCtx, mVDecoder.mStreamIdx,
-                                 0, 1260000, 1260000,
-                                 0); // AVSEEK_FLAG_FRAME);
-  }
-
-  int err;
-
-  err = av_seek_frame(mFormatCtx, mVDecoder.mStreamIdx,
-		      targetDTS, AVSEEK_FLAG_BACKWARD);
+  int err = seekToKeyframeBefore(frameNr);
 #endif
-
   if (err<0) {
     if (D) printf("av_seek_frame error: %d\n",err);
     return err;
   }
 
-  avcodec_flush_buffers(mVDecoder.mDecoderContext);
+  mBackend->flush();
+  seekTimer.stop();
+
+  // frames before the target are only needed as references (but are cached if decoded)
+
+  mBackend->skipUntil(targetPTS);
 
 
 
@@ -399,22 +1098,32 @@ int Decoder::seekToFrame(int64_t frameNr, Direction direction)
   AVFrame* frame = av_frame_alloc();
 
   int64_t last_pts_decoded = AV_NOPTS_VALUE;
+  int nForwardFrames = 0;
 
   for (;;) {
     // read next frame
 
     int got_picture = 0;
     err = read_video_frame(frame, &got_picture);
+    nForwardFrames++;
 
     if (D) printf("seek: got pts=%ld, want pts=%ld\n",frame->pkt_pts,targetPTS);
     //if (frame->pkt_pts == AV_NOPTS_VALUE) { return -1; }
 
 
+    // all decoded frames go into the cache, such that later backward steps are cheap
+
+    if (got_picture) {
+      cacheFrame(findFrameNrWithPTS(frame->pkt_pts), frame);
+    }
+
+
     // case 1: target frame reached
 
     if (frame->pkt_pts == targetPTS) {
       mCurrentFrame = frame;
       mCurrentFrameNumber = frameNr;
+      mDecodedFrameNumber = frameNr;
       break;
     }
 
@@ -443,12 +1152,18 @@ int Decoder::seekToFrame(int64_t frameNr, Direction direction)
         }
 
         assert(mCurrentFrameNumber >= 0);
+        mDecodedFrameNumber = mCurrentFrameNumber;
         break;
 
       case Backwards:
         assert(last_pts_decoded != AV_NOPTS_VALUE);
 
-        av_frame_unref(frame);
+        // the previous frame is usually still in the cache, otherwise we seek again
+
+        mCurrentFrame = NULL;
+        mDecodedFrameNumber = findFrameNrWithPTS(frame->pkt_pts);
+        av_frame_free(&frame);
+        if (mStats) mStats->addSeekForwardFrames(nForwardFrames);
         return seekToFrame( getFrameNrWithPTS(last_pts_decoded), Exact);
       }
 
@@ -468,10 +1183,45 @@ int Decoder::seekToFrame(int64_t frameNr, Direction direction)
 
   //assert(mCurrentFrame->pkt_pts == targetPTS);
 
+  if (mStats) mStats->addSeekForwardFrames(nForwardFrames);
+
   return err;
 }
 
 
+/* Position the demuxer such that decoding starts at a keyframe before 'frameNr'.
+ */
+int Decoder::seekToKeyframeBefore(int64_t frameNr)
+{
+  if (mByteSeek) {
+    // the keyframe starting the GOP of the target (which may be the target itself)
+
+    int64_t key = getKeyframeBeforeFrameNr(frameNr+1);
+
+    if (key>=0 && mFrameInfos[key].pos >= 0) {
+      int err = av_seek_frame(mFormatCtx, mVDecoder.mStreamIdx,
+                              mFrameInfos[key].pos, AVSEEK_FLAG_BYTE);
+      if (err>=0) {
+        return err;
+      }
+    }
+
+    // no file position known or byte seek failed -> use the timestamp
+  }
+
+
+  /* Find the corresponding DTS for the frame and skip to that timestamp.
+     (Skipping usually uses the DTS. This is also safer than the PTS, since
+     the DTS is always smaller/equal.)
+   */
+
+  int64_t targetDTS = mFrameInfos[frameNr].dts;
+
+  return av_seek_frame(mFormatCtx, mVDecoder.mStreamIdx,
+                       targetDTS, AVSEEK_FLAG_BACKWARD);
+}
+
+
 int64_t Decoder::getKeyframeBeforeFrameNr(int64_t frameNr) const
 {
   for (int f=frameNr-1; f>=0; f--) {
@@ -483,14 +1233,781 @@ int64_t Decoder::getKeyframeBeforeFrameNr(int64_t frameNr) const
 }
 
 
+int64_t Decoder::findFrameNrWithPTS(int64_t pts) const
+{
+  // mFrameInfos is sorted by PTS
+
+  auto it = std::lower_bound(mFrameInfos.begin(), mFrameInfos.end(), pts,
+                             [](const frameinfo& fi, int64_t pts) { return fi.pts < pts; });
+
+  if (it != mFrameInfos.end() && it->pts == pts) {
+    return it - mFrameInfos.begin();
+  }
+
+  return -1;
+}
+
+
 int64_t Decoder::getFrameNrWithPTS(int64_t pts) const
 {
-  for (int64_t f=0;f<mFrameInfos.size();f++) {
-    if (mFrameInfos[f].pts == pts) {
-      return f;
+  int64_t f = findFrameNrWithPTS(pts);
+  assert(f>=0);
+  return f;
+}
+
+
+// --- parallel GOP decoding ---
+
+namespace {
+
+  struct GOP
+  {
+    std::vector<AVPacket> packets;
+  };
+
+
+  typedef BoundedQueue<GOP*> GOPQueue; // from the demuxing thread to the decoder threads
+
+
+  struct GOPDecoderThread
+  {
+    AVCodecContext* ctx;
+    const std::function<void(AVFrame*)>* output; // called with each decoded frame
+
+    int64_t nDecoded;
+    double  wallTime, cpuTime;
+
+    void run(GOPQueue* queue)
+    {
+      AVFrame* frame = av_frame_alloc();
+
+      GOP* gop;
+      while (queue->pop(gop)) {
+        double wallStart = wallClockSeconds();
+        double cpuStart  = threadCPUSeconds();
+
+        avcodec_flush_buffers(ctx);
+
+        for (size_t i=0;i<=gop->packets.size();i++) {
+          AVPacket emptyPacket;
+          av_init_packet(&emptyPacket);
+          emptyPacket.data = NULL;
+          emptyPacket.size = 0;
+
+          bool flush = (i==gop->packets.size());
+          AVPacket* packet = (flush ? &emptyPacket : &gop->packets[i]);
+
+          // at the end, drain the frames still buffered in the decoder
+
+          int got_picture;
+          do {
+            got_picture = 0;
+            avcodec_decode_video2(ctx, frame, &got_picture, packet);
+
+            if (got_picture) {
+              nDecoded++;
+              (*output)(frame);
+              av_frame_unref(frame);
+            }
+          } while (flush && got_picture);
+
+          if (!flush) {
+            av_free_packet(packet);
+          }
+        }
+
+        delete gop;
+
+        wallTime += wallClockSeconds() - wallStart;
+        cpuTime  += threadCPUSeconds() - cpuStart;
+      }
+
+      av_frame_free(&frame);
+    }
+  };
+
+
+  // One codec context per thread, copied from the main context.
+
+  bool openGOPDecoders(std::vector<GOPDecoderThread>& decoders, AVCodec* codec,
+                       const AVCodecContext* mainContext,
+                       const std::function<void(AVFrame*)>* output)
+  {
+    for (auto& d : decoders) {
+      d.ctx = avcodec_alloc_context3(codec);
+      avcodec_copy_context(d.ctx, mainContext);
+      d.ctx->refcounted_frames = 1;
+      d.ctx->thread_count = 1; // we parallelize over GOPs
+
+      if (avcodec_open2(d.ctx, codec, NULL) < 0) {
+        for (auto& d : decoders) {
+          avcodec_free_context(&d.ctx);
+        }
+        return false;
+      }
+
+      d.output = output;
+      d.nDecoded = 0;
+      d.wallTime = d.cpuTime = 0;
     }
+
+    return true;
   }
 
-  assert(false);
-  return -1;
+
+  // Free the codec contexts and collect the statistics of the decoder threads.
+
+  void finishGOPDecoders(std::vector<GOPDecoderThread>& decoders, Statistics* stats,
+                         double demuxBusy, double elapsed)
+  {
+    double decodeBusy = 0;
+
+    for (auto& d : decoders) {
+      if (stats) {
+        stats->count(Statistics::Counter_FramesDecoded, d.nDecoded);
+        stats->addTime(Statistics::Stage_Decode, d.wallTime, d.cpuTime);
+      }
+
+      decodeBusy += d.wallTime;
+      avcodec_free_context(&d.ctx);
+    }
+
+    if (stats) {
+      stats->addPipelineLoad(Statistics::Pipeline_Demux,  1, demuxBusy, elapsed);
+      stats->addPipelineLoad(Statistics::Pipeline_Decode, decoders.size(), decodeBusy, elapsed);
+    }
+  }
+}
+
+
+bool Decoder::decodeFramesParallel(const std::vector<int64_t>& frameNrs, int nThreads,
+                                   std::vector<AVFrame*>& frames)
+{
+  frames.assign(frameNrs.size(), NULL);
+
+  if (!mClosedGOPs || frameNrs.empty()) {
+    return false;
+  }
+
+  nThreads = std::max(nThreads, 1);
+
+  std::map<int64_t,size_t> wanted;
+  for (size_t i=0;i<frameNrs.size();i++) {
+    wanted[ mFrameInfos[frameNrs[i]].pts ] = i;
+  }
+
+  int64_t lastPTS = mFrameInfos[frameNrs.back()].pts;
+
+  std::function<void(AVFrame*)> output = [&](AVFrame* frame) {
+    auto w = wanted.find(frame->pkt_pts);
+    if (w != wanted.end()) {
+      frames[w->second] = av_frame_clone(frame);
+    }
+  };
+
+
+  // If something has been decoded already, start again at the beginning of the file.
+  // Otherwise, the input is still positioned at the start of the index.
+
+  if (mDecodedFrameNumber >= 0 && reopenInput() != 0) {
+    return false;
+  }
+
+
+  // --- one codec context per thread ---
+
+  std::vector<GOPDecoderThread> decoders(nThreads);
+
+  if (!openGOPDecoders(decoders, mVDecoder.mDecoder, mVDecoder.mDecoderContext, &output)) {
+    return false;
+  }
+
+  freeCurrentFrame();
+  mCurrentFrameNumber = -1;
+  mDecodedFrameNumber = -1;
+
+  GOPQueue queue(2*nThreads); // limits the number of packets in memory
+
+  double startTime = wallClockSeconds();
+  double demuxBusy = 0;
+
+  std::vector<std::thread> threads;
+  for (auto& d : decoders) {
+    threads.push_back(std::thread(&GOPDecoderThread::run, &d, &queue));
+  }
+
+
+  // --- demux sequentially, split into GOPs and skip those without wanted frames ---
+
+  GOP* gop = NULL;
+  bool gopWanted = false;
+
+  auto finishGOP = [&]() {
+    if (gop && gopWanted) {
+      queue.push(gop);
+    }
+    else if (gop) {
+      for (auto& p : gop->packets) av_free_packet(&p);
+      delete gop;
+    }
+
+    gop = NULL;
+    gopWanted = false;
+  };
+
+  AVPacket packet;
+  for (;;) {
+    double readStart = wallClockSeconds();
+    StageTimer demuxTimer(mStats, Statistics::Stage_Demux);
+    int err = av_read_frame(mFormatCtx, &packet);
+    demuxTimer.stop();
+    demuxBusy += wallClockSeconds() - readStart;
+
+    if (err != 0) break;
+
+    if (mStats) mStats->count(Statistics::Counter_PacketsDemuxed);
+
+    if (packet.stream_index != mVDecoder.mStreamIdx) {
+      av_free_packet(&packet);
+      continue;
+    }
+
+    if (packet.flags & AV_PKT_FLAG_KEY) {
+      finishGOP();
+
+      // all further frames are displayed after this keyframe (closed GOPs)
+
+      if (packet.pts > lastPTS) {
+        av_free_packet(&packet);
+        break;
+      }
+
+      gop = new GOP;
+    }
+
+    if (gop==NULL) { // packets before the first keyframe cannot be decoded
+      av_free_packet(&packet);
+      continue;
+    }
+
+    av_dup_packet(&packet); // make the packet data independent of the demuxer
+    gop->packets.push_back(packet);
+
+    if (wanted.count(packet.pts)) {
+      gopWanted = true;
+    }
+  }
+
+  finishGOP();
+  queue.close();
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  finishGOPDecoders(decoders, mStats, demuxBusy, wallClockSeconds() - startTime);
+
+  // rewind, such that sequential decoding starts again from the beginning
+
+  reopenInput();
+
+  return true;
+}
+
+
+bool Decoder::decodeFrames(const std::vector<int64_t>& frameNrs, int nThreads,
+                           const FrameCallback& onFrame)
+{
+  if (frameNrs.empty()) {
+    return true;
+  }
+
+  nThreads = std::max(nThreads, 1);
+
+  std::map<int64_t,size_t> wanted;
+  for (size_t i=0;i<frameNrs.size();i++) {
+    wanted[ mFrameInfos[frameNrs[i]].pts ] = i;
+  }
+
+  // GOPs read for different targets may overlap, each frame is output only once
+
+  std::unique_ptr<std::atomic<bool>[]> delivered(new std::atomic<bool>[frameNrs.size()]);
+  for (size_t i=0;i<frameNrs.size();i++) {
+    delivered[i] = false;
+  }
+
+  std::function<void(AVFrame*)> output = [&](AVFrame* frame) {
+    auto w = wanted.find(frame->pkt_pts);
+    if (w != wanted.end() && !delivered[w->second].exchange(true)) {
+      onFrame(w->second, av_frame_clone(frame));
+    }
+  };
+
+  std::vector<GOPDecoderThread> decoders(nThreads);
+
+  if (!openGOPDecoders(decoders, mVDecoder.mDecoder, mVDecoder.mDecoderContext, &output)) {
+    return false;
+  }
+
+  freeCurrentFrame();
+  mCurrentFrameNumber = -1;
+  mDecodedFrameNumber = -1;
+
+  GOPQueue queue(2*nThreads);
+
+  double startTime = wallClockSeconds();
+  double demuxBusy = 0;
+
+  std::vector<std::thread> threads;
+  for (auto& d : decoders) {
+    threads.push_back(std::thread(&GOPDecoderThread::run, &d, &queue));
+  }
+
+
+  // --- demux: for each keyframe before a target, the packets up to the target ---
+
+  // The keyframe packet that ended the previous run. If the next run starts
+  // there, we continue reading instead of seeking.
+
+  AVPacket carry;
+  bool    haveCarry = false;
+  int64_t carryKey  = -1;
+
+  size_t next=0;
+  while (next < frameNrs.size()) {
+    auto k = std::upper_bound(mKeyframes.begin(), mKeyframes.end(), frameNrs[next]);
+    if (k == mKeyframes.begin()) {
+      next++; // no keyframe before this frame
+      continue;
+    }
+
+    int64_t key = *(k-1);
+
+
+    // all targets starting at this keyframe are decoded from one packet run
+
+    std::set<int64_t> pending;
+    int64_t maxPTS = AV_NOPTS_VALUE;
+
+    size_t end = next;
+    while (end < frameNrs.size() &&
+           (k == mKeyframes.end() || frameNrs[end] < *k)) {
+      int64_t pts = mFrameInfos[frameNrs[end]].pts;
+      pending.insert(pts);
+      maxPTS = std::max(maxPTS, pts);
+      end++;
+    }
+
+    GOP* gop = new GOP;
+
+    if (haveCarry && carryKey == key) {
+      gop->packets.push_back(carry);
+      haveCarry = false;
+    }
+    else {
+      if (haveCarry) {
+        av_free_packet(&carry);
+        haveCarry = false;
+      }
+
+      double seekStart = wallClockSeconds();
+      StageTimer seekTimer(mStats, Statistics::Stage_Seek);
+      if (mStats) mStats->count(Statistics::Counter_Seeks);
+
+      seekToKeyframeBefore(key);
+
+      seekTimer.stop();
+      demuxBusy += wallClockSeconds() - seekStart;
+    }
+
+
+    // Read until the next keyframe after all targets were seen. A target frame
+    // may also follow the next keyframe in decoding order (open GOPs).
+    // Since DTS <= PTS, a target not seen up to DTS > maxPTS does not exist.
+
+    AVPacket packet;
+    for (;;) {
+      double readStart = wallClockSeconds();
+      StageTimer demuxTimer(mStats, Statistics::Stage_Demux);
+      int err = av_read_frame(mFormatCtx, &packet);
+      demuxTimer.stop();
+      demuxBusy += wallClockSeconds() - readStart;
+
+      if (err != 0) break;
+
+      if (mStats) mStats->count(Statistics::Counter_PacketsDemuxed);
+
+      if (packet.stream_index != mVDecoder.mStreamIdx) {
+        av_free_packet(&packet);
+        continue;
+      }
+
+      bool isKey = !!(packet.flags & AV_PKT_FLAG_KEY);
+
+      if (isKey && !gop->packets.empty() &&
+          (pending.empty() || (packet.dts != AV_NOPTS_VALUE && packet.dts > maxPTS))) {
+        av_dup_packet(&packet);
+        carry = packet;
+        haveCarry = true;
+        carryKey = findFrameNrWithPTS(packet.pts);
+        break;
+      }
+
+      if (gop->packets.empty() && !isKey) { // packets before the keyframe cannot be decoded
+        av_free_packet(&packet);
+        continue;
+      }
+
+      av_dup_packet(&packet); // make the packet data independent of the demuxer
+      gop->packets.push_back(packet);
+      pending.erase(packet.pts);
+    }
+
+    if (!gop->packets.empty()) {
+      queue.push(gop);
+    }
+    else {
+      delete gop;
+    }
+
+    next = end;
+  }
+
+  if (haveCarry) {
+    av_free_packet(&carry);
+  }
+
+  queue.close();
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  finishGOPDecoders(decoders, mStats, demuxBusy, wallClockSeconds() - startTime);
+
+
+  // rewind, such that the state matches mDecodedFrameNumber = -1 again
+
+  seekToKeyframeBefore(0);
+  mBackend->flush();
+
+  for (size_t i=0;i<frameNrs.size();i++) {
+    if (!delivered[i]) {
+      onFrame(i, NULL);
+    }
+  }
+
+  return true;
+}
+
+
+void Decoder::prefetchFrames(const std::vector<int64_t>& frameNrs, int bufferSize)
+{
+  stopPrefetch();
+
+  if (frameNrs.empty() || bufferSize<=0) {
+    return;
+  }
+
+  std::unique_ptr<Prefetcher> prefetcher(new Prefetcher(bufferSize));
+
+  if (prefetcher->decoder.openCopy(*this) != 0) {
+    return; // decode everything in this thread
+  }
+
+  prefetcher->frames = frameNrs;
+  std::sort(prefetcher->frames.begin(), prefetcher->frames.end());
+  prefetcher->frames.erase(std::unique(prefetcher->frames.begin(), prefetcher->frames.end()),
+                           prefetcher->frames.end());
+
+  prefetcher->thread = std::thread(&Prefetcher::run, prefetcher.get());
+
+  mPrefetcher = std::move(prefetcher);
+}
+
+
+void Decoder::stopPrefetch()
+{
+  if (!mPrefetcher) {
+    return;
+  }
+
+  Prefetcher& p = *mPrefetcher;
+  p.stop = true;
+
+  if (p.haveNext) {
+    av_frame_free(&p.next.frame);
+  }
+
+  // drain the buffer, such that the thread is not blocked and can finish
+
+  PrefetchedFrame item;
+  while (p.buffer.pop(item)) {
+    av_frame_free(&item.frame);
+  }
+
+  p.thread.join();
+
+  mPrefetcher.reset();
+}
+
+
+bool Decoder::takePrefetchedFrame(int64_t frameNr)
+{
+  Prefetcher& p = *mPrefetcher;
+
+  if (!std::binary_search(p.frames.begin(), p.frames.end(), frameNr)) {
+    return false;
+  }
+
+  for (;;) {
+    if (!p.haveNext) {
+      if (!p.buffer.pop(p.next)) {
+        return false; // prefetching ended
+      }
+      p.haveNext = true;
+    }
+
+    if (p.next.frameNr > frameNr) {
+      return false; // already passed (frames are requested out of order)
+    }
+
+    AVFrame* frame = p.next.frame;
+    bool found = (p.next.frameNr == frameNr);
+    p.haveNext = false;
+
+    if (!found) {
+      av_frame_free(&frame); // skipped by the caller
+      continue;
+    }
+
+    if (!frame) {
+      return false;
+    }
+
+    freeCurrentFrame();
+    mCurrentFrame = frame;
+    mCurrentFrameNumber = frameNr;
+
+    if (mStats) mStats->count(Statistics::Counter_PrefetchHits);
+    return true;
+  }
+}
+
+
+int Decoder::openCopy(const Decoder& main)
+{
+  close();
+
+  const char* filename = main.mInputFileName.c_str();
+
+  mFormatCtx = avformat_alloc_context();
+
+  mIOMode = main.mIOMode;
+  if (mInput.open(filename, mIOMode)) {
+    mFormatCtx->pb = mInput.getAVIOContext();
+    mFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
+
+  int err;
+  if ((err=avformat_open_input(&mFormatCtx, filename, NULL, NULL)) < 0) {
+    mInput.close();
+    return err;
+  }
+
+
+  // the codec parameters are copied instead of probing the stream again
+
+  int streamIdx = main.mVDecoder.mStreamIdx;
+  if (streamIdx >= mFormatCtx->nb_streams) {
+    return 1;
+  }
+
+  AVStream* stream = mFormatCtx->streams[streamIdx];
+  const AVStream* mainStream = main.mVDecoder.mStream;
+
+  if (stream->time_base.num != mainStream->time_base.num ||
+      stream->time_base.den != mainStream->time_base.den) {
+    return 1;
+  }
+
+  if (stream->start_time == AV_NOPTS_VALUE) { stream->start_time = mainStream->start_time; }
+  if (stream->avg_frame_rate.num == 0) { stream->avg_frame_rate = mainStream->avg_frame_rate; }
+  if (stream->r_frame_rate.num == 0)   { stream->r_frame_rate   = mainStream->r_frame_rate; }
+
+  if ((err=avcodec_copy_context(stream->codec, main.mVDecoder.mDecoderContext)) < 0) {
+    return err;
+  }
+
+  // the same backend as the main decoder (which already reported a fallback)
+
+  mBackendType = (strcmp(main.getBackendName(), "libde265")==0 ? Backend_LibDE265 : Backend_LibAVCodec);
+  mBackendThreads = main.mBackendThreads;
+
+  if ((err=openBackend(main.mVDecoder.mDecoder, stream->codec)) < 0) {
+    return err;
+  }
+
+  mVDecoder.mDecoder = main.mVDecoder.mDecoder;
+  mVDecoder.mDecoderContext = stream->codec;
+  mVDecoder.mStream = stream;
+  mVDecoder.mStreamIdx = streamIdx;
+
+  for (int i=0;i<mFormatCtx->nb_streams;i++) {
+    if (i != streamIdx) {
+      mFormatCtx->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+
+
+  // index and seek setup of the main decoder
+
+  mFrameInfos = main.mFrameInfos;
+  mKeyframes  = main.mKeyframes;
+  mClosedGOPs = main.mClosedGOPs;
+  mSeekMode   = main.mSeekMode;
+  mByteSeek   = main.mByteSeek;
+  mRangeBeginFrame = main.mRangeBeginFrame;
+  mRangeEndFrame   = main.mRangeEndFrame;
+  mInputFileName   = main.mInputFileName;
+
+  // only forward steps: decoded frames are not cached (they would not count to any memory limit)
+
+  mFrameCacheSize = 0;
+
+  seekToKeyframeBefore(0);
+  mBackend->flush();
+
+  return 0;
+}
+
+
+// --- decoder backends ---
+
+/* Open the input file again, such that it is read from the beginning without seeking.
+   The stream parameters are kept instead of probing the stream again. On failure,
+   the decoder is closed.
+ */
+int Decoder::reopenInput()
+{
+  stopPrefetch();
+  freeCurrentFrame();
+  mCurrentFrameNumber = -1;
+  mDecodedFrameNumber = -1;
+
+
+  // keep the parameters of the stream, which is freed with the format context
+
+  AVCodec* codec = mVDecoder.mDecoder;
+  int streamIdx  = mVDecoder.mStreamIdx;
+
+  AVRational timeBase     = mVDecoder.mStream->time_base;
+  int64_t    startTime    = mVDecoder.mStream->start_time;
+  AVRational avgFrameRate = mVDecoder.mStream->avg_frame_rate;
+  AVRational rFrameRate   = mVDecoder.mStream->r_frame_rate;
+
+  AVCodecContext* params = avcodec_alloc_context3(codec);
+
+  int err;
+  if ((err=avcodec_copy_context(params, mVDecoder.mDecoderContext)) < 0) {
+    avcodec_free_context(&params);
+    close();
+    return err;
+  }
+
+  // the same backend again (a fallback has already been reported)
+
+  mBackendType = (strcmp(getBackendName(), "libde265")==0 ? Backend_LibDE265 : Backend_LibAVCodec);
+
+  mBackend.reset();
+  avformat_close_input(&mFormatCtx);
+  mInput.close();
+
+
+  // open the file as in openCopy()
+
+  const char* filename = mInputFileName.c_str();
+
+  mFormatCtx = avformat_alloc_context();
+
+  if (mInput.open(filename, mIOMode)) {
+    mFormatCtx->pb = mInput.getAVIOContext();
+    mFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
+
+  if ((err=avformat_open_input(&mFormatCtx, filename, NULL, NULL)) < 0 ||
+      streamIdx >= mFormatCtx->nb_streams) {
+    avcodec_free_context(&params);
+    close();
+    return err<0 ? err : 1;
+  }
+
+  AVStream* stream = mFormatCtx->streams[streamIdx];
+
+  stream->time_base = timeBase;
+  if (stream->start_time == AV_NOPTS_VALUE) { stream->start_time = startTime; }
+  if (stream->avg_frame_rate.num == 0) { stream->avg_frame_rate = avgFrameRate; }
+  if (stream->r_frame_rate.num == 0)   { stream->r_frame_rate   = rFrameRate; }
+
+  err = avcodec_copy_context(stream->codec, params);
+  avcodec_free_context(&params);
+
+  if (err<0 || (err=openBackend(codec, stream->codec)) < 0) {
+    close();
+    return err;
+  }
+
+  mVDecoder.mDecoderContext = stream->codec;
+  mVDecoder.mStream = stream;
+
+  for (int i=0;i<mFormatCtx->nb_streams;i++) {
+    if (i != streamIdx) {
+      mFormatCtx->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+
+  return 0;
+}
+
+
+int Decoder::openBackend(AVCodec* codec, AVCodecContext* ctx)
+{
+#ifdef HAVE_LIBDE265
+  if (ctx->codec_id == AV_CODEC_ID_HEVC && mBackendType != Backend_LibAVCodec) {
+    int nThreads = mBackendThreads;
+    if (nThreads <= 0) {
+      nThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    mBackend.reset(createLibDE265Backend(ctx, nThreads));
+    if (mBackend) {
+      return 0;
+    }
+
+    // otherwise fall back to libavcodec
+  }
+#endif
+
+  // only 'auto' falls back silently
+
+  if (mBackendType == Backend_LibDE265) {
+#ifdef HAVE_LIBDE265
+    const char* reason = (ctx->codec_id != AV_CODEC_ID_HEVC ? "the video is not HEVC"
+                                                            : "the decoder could not be initialized");
+#else
+    const char* reason = "not available in this build";
+#endif
+    fprintf(stderr, "cannot decode with libde265 (%s), using libavcodec\n", reason);
+  }
+
+  int err;
+  mBackend.reset(createLibAVCodecBackend(codec, ctx, &err));
+
+  return mBackend ? 0 : err;
+}
+
+
+const char* Decoder::getBackendName() const
+{
+  return mBackend ? mBackend->name() : "";
 }
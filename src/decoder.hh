@@ -27,6 +27,12 @@
 
 #include <vector>
 #include <string>
+#include <functional>
+#include <memory>
+#include "stats.hh"
+#include "io.hh"
+
+class DecoderBackend;
 
 extern "C" {
 #include "libavformat/avformat.h"
@@ -43,6 +49,83 @@ public:
   ~Decoder();
 
   int loadMovie(const char* filename);
+  void close();
+
+  // Timing and counters are collected into 'stats' (may be NULL).
+  void setStatistics(Statistics* stats) { mStats = stats; }
+
+  // How the input file is read (takes effect with the next loadMovie()).
+  void setIOMode(FileInput::Mode mode) { mIOMode = mode; }
+
+
+  // A position in the video, as seconds from the stream start or as frame number.
+  struct Position
+  {
+    enum Unit { Unset, Seconds, Frames } unit;
+    double value;
+
+    Position() : unit(Unset), value(0) { }
+  };
+
+  /* Restrict the decoder to a time range (takes effect with the next loadMovie()).
+     Only the part of the stream from the keyframe before 'start' up to 'end'
+     is indexed. Frame positions are converted with the average frame rate.
+   */
+  void setRange(const Position& start, const Position& end) { mRangeStart=start; mRangeEnd=end; }
+
+  /* How seekToFrame() positions the demuxer:
+     Seek_Timestamp: av_seek_frame() to the DTS of the target frame
+     Seek_Byte:      jump to the file offset of the keyframe before the target
+                     (offsets are recorded in the index scan)
+     Seek_Auto:      byte seeks for formats with timestamp discontinuities (MPEG-TS/PS)
+   */
+  enum SeekMode { Seek_Auto, Seek_Timestamp, Seek_Byte };
+
+  void setSeekMode(SeekMode mode) { mSeekMode = mode; }
+
+  /* Video decoder for seeking and sequential decoding (takes effect with the next loadMovie()):
+     Backend_Auto:       libde265 for HEVC, if compiled in, otherwise libavcodec
+     Backend_LibAVCodec: always libavcodec
+     Backend_LibDE265:   libde265; warns on stderr and uses libavcodec if the video is not
+                         HEVC or libde265 is not available
+     libde265 decodes with 'nThreads' worker threads (0: all cores). GOP-parallel
+     decoding (decodeFrames(), preloading) always uses libavcodec.
+   */
+  enum Backend { Backend_Auto, Backend_LibAVCodec, Backend_LibDE265 };
+
+  void setBackend(Backend backend, int nThreads=0) { mBackendType = backend; mBackendThreads = nThreads; }
+
+  // Name of the backend decoding the current video ("" if none is open).
+  const char* getBackendName() const;
+
+  /* Limits for probing the stream parameters in avformat_find_stream_info()
+     (bytes and microseconds, 0: libavformat defaults). Take effect with the next loadMovie().
+   */
+  void setProbeLimits(int64_t probeSize, int64_t analyzeDuration) {
+    mProbeSize = probeSize; mAnalyzeDuration = analyzeDuration;
+  }
+
+  /* File keeping the stream parameters and the frame index between runs ("": none).
+     If it matches the input (file size, modification time and range), the
+     stream probing and the index scan are skipped. Stream probing is still done
+     when the container does not provide parameters the cache lacks. The cache
+     is (re)written after each scan.
+   */
+  void setIndexCache(const std::string& filename) { mIndexCacheFile = filename; }
+
+  // Default index cache location for a video: "<video>.index"
+  static std::string defaultIndexCachePath(const char* filename);
+
+  // Wall time of the last loadMovie(), until the video was ready for decoding.
+  double getOpenTime() const { return mOpenTime; }
+  bool   usedIndexCache() const { return mUsedIndexCache; }
+
+  /* Number of decoded frames kept for backward steps and re-visits (0: no cache).
+     The cache holds references, the frames themselves are not copied.
+   */
+  void setFrameCacheSize(int nFrames);
+
+  static const int DefaultFrameCacheSize = 16;
 
   /*
     PLAYBACK state:
@@ -62,11 +145,24 @@ public:
   int64_t getVideoDuration() const; // div by AV_TIME_BASE gives seconds
   int64_t getNFrames() const { return mFrameInfos.size(); }
 
+  // Frames [begin;end) lie within the range set with setRange().
+  int64_t getRangeBegin() const { return mRangeBeginFrame; }
+  int64_t getRangeEnd() const { return mRangeEndFrame; }
+
+  /* Frame numbers are indices into the frame index, which starts at the keyframe
+     before the range start. This is the number of that first frame in the video
+     (0 without a range start; otherwise estimated from its PTS with the average
+     frame rate, like the frame positions of setRange()).
+   */
+  int64_t getIndexBase() const;
+
   const AVStream* getVideoStream() const { return mVDecoder.mStream; }
 
   int64_t getFramePTS(int frame) const { return mFrameInfos[frame].pts; }
   int64_t getFrameNrWithPTS(int64_t pts) const;
+  int64_t findFrameNrWithPTS(int64_t pts) const; // -1 if not found
   const std::string& getInputFileName() const { return mInputFileName; }
+  int64_t getBytesRead() const;
 
   double PTS2Time(int64_t pts) const { return double(pts) * mVDecoder.mStream->time_base.num /
       mVDecoder.mStream->time_base.den; }
@@ -87,6 +183,9 @@ public:
   int64_t getCurrentFrameNr() const { return mCurrentFrameNumber; }
   int64_t getKeyframeBeforeFrameNr(int64_t frameNr) const;
 
+  // Frame numbers of all keyframes, sorted.
+  const std::vector<int64_t>& getKeyframes() const { return mKeyframes; }
+
   enum Direction { Backwards, Forwards, Exact };
 
   // Direction specifies in which direction we should seek further when the requested
@@ -100,6 +199,59 @@ public:
   int seekToPrevVideoFrame();
 
 
+  // --- parallel decoding without seeking ---
+
+  // True if every GOP can be decoded on its own (no frames referencing the previous GOP).
+  bool hasClosedGOPs() const { return mClosedGOPs; }
+
+  /* Decode the (sorted) frames by reading the stream sequentially from the start,
+     without seeking within the stream (the input is reopened if it is not at the
+     start anymore). Each GOP containing a requested frame is decoded on one of
+     'nThreads' threads with its own codec context; GOPs without requested frames
+     are skipped.
+
+     'frames' receives new references (to be freed with av_frame_free()), or NULL
+     for frames that could not be decoded. Returns false if the stream does not
+     allow this (open GOPs), such that sequential decoding has to be used.
+     Afterwards, the input is reopened and there is no current frame.
+   */
+  bool decodeFramesParallel(const std::vector<int64_t>& frameNrs, int nThreads,
+                            std::vector<AVFrame*>& frames);
+
+
+  // --- pipelined decoding with seeking ---
+
+  typedef std::function<void(size_t index, AVFrame* frame)> FrameCallback;
+
+  /* Decode the (sorted) frames on 'nThreads' decoder threads, each with its own
+     codec context. The calling thread demuxes: it seeks to the keyframe before
+     each target (or continues reading if the stream is already there) and queues
+     the packets up to the target, such that demuxing the next target overlaps
+     the decoding of the previous ones.
+
+     'onFrame' is called from the decoder threads as soon as a requested frame
+     is decoded, with its index in 'frameNrs' and a new reference (to be freed
+     with av_frame_free()). Frames that could not be decoded are reported with
+     NULL at the end, from the calling thread. Afterwards, there is no current
+     frame and the stream is rewound. Returns false if no decoder could be opened.
+   */
+  bool decodeFrames(const std::vector<int64_t>& frameNrs, int nThreads,
+                    const FrameCallback& onFrame);
+
+
+  // --- prefetching ---
+
+  /* Decode the (sorted) frames that will be requested next on a background thread,
+     with its own demuxer and codec context, keeping up to 'bufferSize' decoded
+     frames ahead. seekToFrame() takes these frames from the buffer; frames not in
+     the list are decoded as usual. The background thread gives read-ahead hints
+     for the byte ranges of the next GOPs (needs our own file input and keyframe
+     file positions). The prefetch ends with stopPrefetch() or close().
+   */
+  void prefetchFrames(const std::vector<int64_t>& frameNrs, int bufferSize);
+  void stopPrefetch();
+
+
   // --- playback ---
 
   //void    startPlayback(bool forward=true);
@@ -115,6 +267,22 @@ public:
 private:
   std::string mInputFileName;
 
+  Statistics* mStats;
+
+  FileInput::Mode mIOMode;
+  FileInput mInput;
+
+  Position mRangeStart, mRangeEnd;
+  int64_t  mRangeBeginFrame, mRangeEndFrame;
+
+  int64_t positionToPTS(const Position&) const;
+
+  int64_t mProbeSize, mAnalyzeDuration;
+
+  std::string mIndexCacheFile;
+  bool   mUsedIndexCache;
+  double mOpenTime;
+
   //enum DecoderState { STATE_CLOSED, STATE_PLAYBACK, STATE_PAUSED, STATE_ERROR } mState;
 
   AVFormatContext* mFormatCtx;
@@ -129,6 +297,12 @@ private:
 
   stream_decoder mVDecoder;
 
+  std::unique_ptr<DecoderBackend> mBackend;  // decodes the packets of mVDecoder's stream
+  Backend mBackendType;
+  int     mBackendThreads;
+
+  int openBackend(AVCodec* codec, AVCodecContext* ctx);
+
   //std::vector<stream_decoder> mDecoders;
 
 
@@ -136,17 +310,75 @@ private:
   {
     int64_t pts;
     int64_t dts;
+    int64_t pos;  // file offset of keyframe packets (-1 if unknown or no keyframe)
     bool    key;
   };
 
   std::vector<frameinfo> mFrameInfos;
+  std::vector<int64_t>  mKeyframes;
+  bool mClosedGOPs;
+
+  SeekMode mSeekMode;
+  bool     mByteSeek;  // mSeekMode resolved for the current input
+
+  int seekToKeyframeBefore(int64_t frameNr);
 
   AVFrame* mCurrentFrame;
   int64_t  mCurrentFrameNumber;
 
+  int64_t  mDecodedFrameNumber;  // last frame output by the codec; differs from
+                                 // mCurrentFrameNumber if that came from the cache
+
+
+  // --- decoded frame cache ---
+
+  struct cachedframe
+  {
+    int64_t  frameNr;
+    AVFrame* frame;
+  };
+
+  std::vector<cachedframe> mFrameCache; // least recently used first
+  int mFrameCacheSize;
+
+  void cacheFrame(int64_t frameNr, const AVFrame* frame);
+  bool loadCachedFrame(int64_t frameNr); // makes it the current frame
+  void clearFrameCache();
+
 
   void scanStream();
 
+
+  // --- prefetching ---
+
+  class Prefetcher;
+  std::unique_ptr<Prefetcher> mPrefetcher;
+
+  int  openCopy(const Decoder& main); // open the same input, reusing the stream parameters and index
+  int  reopenInput(); // read again from the beginning of the file, without seeking
+  bool takePrefetchedFrame(int64_t frameNr); // makes it the current frame
+  void finishIndex(); // sort the frame index, resolve the range and rewind
+
+
+  // --- index cache ---
+
+  struct cachedindex
+  {
+    int streamIdx;
+    int codecId, width, height, pixFmt;
+    AVRational timeBase, avgFrameRate, rFrameRate;
+    int64_t startTime, streamDuration, formatDuration;
+    std::vector<uint8_t> extradata;
+
+    Position rangeStart, rangeEnd;
+    bool closedGOPs;
+    std::vector<frameinfo> frames;
+  };
+
+  bool readIndexCache(const char* videoFilename, cachedindex& cache) const;
+  bool writeIndexCache(const char* videoFilename) const;
+  bool applyCachedStreamParameters(const cachedindex& cache);
+
   int  loadNextFrame();
   int  read_video_frame(AVFrame* frame, int* got_picture);
 
@@ -0,0 +1,409 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "decoderbackend.hh"
+
+#include <vector>
+#include <string.h>
+
+extern "C" {
+#include "libavutil/imgutils.h"
+}
+
+#ifdef HAVE_LIBDE265
+#include <libde265/de265.h>
+#endif
+
+
+// --- libavcodec ---
+
+class LibAVCodecBackend : public DecoderBackend
+{
+public:
+  LibAVCodecBackend(AVCodecContext* ctx) : mCtx(ctx) { }
+  ~LibAVCodecBackend() { avcodec_close(mCtx); }
+
+  const char* name() const { return "libavcodec"; }
+
+  int decode(AVFrame* frame, int* got_picture, const AVPacket* packet)
+  {
+    if (packet) {
+      return avcodec_decode_video2(mCtx, frame, got_picture, packet);
+    }
+
+    AVPacket emptyPacket;
+    av_init_packet(&emptyPacket);
+    emptyPacket.data = NULL;
+    emptyPacket.size = 0;
+
+    return avcodec_decode_video2(mCtx, frame, got_picture, &emptyPacket);
+  }
+
+  void flush() { avcodec_flush_buffers(mCtx); }
+
+private:
+  AVCodecContext* mCtx;
+};
+
+
+DecoderBackend* createLibAVCodecBackend(AVCodec* codec, AVCodecContext* ctx, int* err)
+{
+  ctx->refcounted_frames = 1;
+
+  if ((*err = avcodec_open2(ctx, codec, NULL)) < 0) {
+    return NULL;
+  }
+
+  return new LibAVCodecBackend(ctx);
+}
+
+
+
+#ifdef HAVE_LIBDE265
+
+// --- libde265 ---
+
+/* The packets are split into NAL units, which are passed to libde265 one by
+   one. This handles both, length-prefixed NALs (MP4/MKV, with 'hvcC' extradata)
+   and Annex-B byte streams (MPEG-TS, raw HEVC).
+
+   Frame skipping: while skipping, sub-layer non-reference pictures in the highest
+   temporal sub-layer are not passed to the decoder. No other picture refers to
+   them, such that the remaining pictures are decoded correctly.
+ */
+class LibDE265Backend : public DecoderBackend
+{
+public:
+  LibDE265Backend();
+  ~LibDE265Backend();
+
+  bool open(const AVCodecContext* ctx, int nThreads);
+
+  const char* name() const { return "libde265"; }
+
+  int  decode(AVFrame* frame, int* got_picture, const AVPacket* packet);
+  void flush();
+  void skipUntil(int64_t pts) { mSkipUntilPTS = pts; }
+
+private:
+  de265_decoder_context* mCtx;
+
+  int  mNALLengthSize;  // 0: Annex-B start codes
+  std::vector<std::vector<uint8_t> > mParameterSets;  // from the extradata
+
+  bool mFlushed;        // end of stream was signaled
+  int  mMaxTID;         // highest temporal sub-layer, from the SPS
+
+  int64_t mSkipUntilPTS;
+
+  void pushParameterSets();
+  void pushPacket(const uint8_t* data, int size, int64_t pts, bool skip);
+  void pushNAL(const uint8_t* nal, int size, int64_t pts, bool skip);
+
+  bool outputPicture(AVFrame* frame);
+};
+
+
+LibDE265Backend::LibDE265Backend()
+{
+  mCtx = NULL;
+  mNALLengthSize = 0;
+  mFlushed = false;
+  mMaxTID = 0;
+  mSkipUntilPTS = AV_NOPTS_VALUE;
+}
+
+
+LibDE265Backend::~LibDE265Backend()
+{
+  if (mCtx) {
+    de265_free_decoder(mCtx);
+  }
+}
+
+
+static int readBigEndian(const uint8_t* p, int nBytes)
+{
+  int v=0;
+  for (int i=0;i<nBytes;i++) {
+    v = (v<<8) | p[i];
+  }
+  return v;
+}
+
+
+bool LibDE265Backend::open(const AVCodecContext* ctx, int nThreads)
+{
+  const uint8_t* extra = ctx->extradata;
+  int extraSize = ctx->extradata_size;
+
+  // 'hvcC' configuration record: parameter set arrays and the NAL length size
+
+  if (extraSize >= 23 && extra[0]==1) {
+    mNALLengthSize = (extra[21] & 3) + 1;
+
+    int nArrays = extra[22];
+    int p = 23;
+
+    for (int a=0; a<nArrays && p+3 <= extraSize; a++) {
+      int nNALs = readBigEndian(extra+p+1, 2);
+      p += 3;
+
+      for (int n=0; n<nNALs && p+2 <= extraSize; n++) {
+        int size = readBigEndian(extra+p, 2);
+        p += 2;
+
+        if (p+size > extraSize) {
+          return false;
+        }
+
+        mParameterSets.push_back(std::vector<uint8_t>(extra+p, extra+p+size));
+        p += size;
+      }
+    }
+  }
+  else if (extraSize > 0) {
+    mParameterSets.push_back(std::vector<uint8_t>(extra, extra+extraSize)); // Annex-B
+  }
+
+  mCtx = de265_new_decoder();
+  if (!mCtx) {
+    return false;
+  }
+
+  de265_set_parameter_bool(mCtx, DE265_DECODER_PARAM_SUPPRESS_FAULTY_PICTURES, 1);
+
+  if (nThreads > 1 && !de265_isOK(de265_start_worker_threads(mCtx, nThreads))) {
+    return false;
+  }
+
+  pushParameterSets();
+
+  return true;
+}
+
+
+void LibDE265Backend::pushParameterSets()
+{
+  for (const auto& nal : mParameterSets) {
+    if (mNALLengthSize) {
+      pushNAL(nal.data(), nal.size(), 0, false);
+    }
+    else {
+      pushPacket(nal.data(), nal.size(), 0, false);
+    }
+  }
+}
+
+
+void LibDE265Backend::pushNAL(const uint8_t* nal, int size, int64_t pts, bool skip)
+{
+  if (size < 2) {
+    return;
+  }
+
+  int type = (nal[0]>>1) & 0x3F;
+  int tid  = (nal[1] & 7) - 1;
+
+  if (type==33 && size>2) {
+    mMaxTID = (nal[2]>>1) & 7;  // sps_max_sub_layers_minus1
+  }
+
+  // TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N and the reserved non-reference types
+
+  bool nonReference = (type<=14 && (type & 1)==0);
+
+  if (skip && nonReference && tid==mMaxTID) {
+    return;
+  }
+
+  de265_push_NAL(mCtx, nal, size, pts, NULL);
+}
+
+
+void LibDE265Backend::pushPacket(const uint8_t* data, int size, int64_t pts, bool skip)
+{
+  if (mNALLengthSize) {
+    for (int p=0; p+mNALLengthSize <= size; ) {
+      int nalSize = readBigEndian(data+p, mNALLengthSize);
+      p += mNALLengthSize;
+
+      if (nalSize > size-p) {
+        break; // broken packet
+      }
+
+      pushNAL(data+p, nalSize, pts, skip);
+      p += nalSize;
+    }
+  }
+  else {
+    // Annex-B: NALs between start codes (00 00 01, leading zeros are trailing bytes of the previous NAL)
+
+    int start = -1;
+
+    for (int p=0; p+2 < size; p++) {
+      if (data[p]==0 && data[p+1]==0 && data[p+2]==1) {
+        if (start >= 0) {
+          int end = p;
+          while (end > start && data[end-1]==0) end--;
+          pushNAL(data+start, end-start, pts, skip);
+        }
+
+        start = p+3;
+        p += 2;
+      }
+    }
+
+    if (start >= 0) {
+      pushNAL(data+start, size-start, pts, skip);
+    }
+  }
+}
+
+
+int LibDE265Backend::decode(AVFrame* frame, int* got_picture, const AVPacket* packet)
+{
+  av_frame_unref(frame);
+  *got_picture = 0;
+
+  if (packet && packet->size > 0) {
+    bool skip = false;
+
+    if (mSkipUntilPTS != AV_NOPTS_VALUE) {
+      if (packet->pts != AV_NOPTS_VALUE && packet->pts < mSkipUntilPTS) {
+        skip = true;
+      }
+      else {
+        mSkipUntilPTS = AV_NOPTS_VALUE;
+      }
+    }
+
+    pushPacket(packet->data, packet->size, packet->pts, skip);
+  }
+  else if (!mFlushed) {
+    de265_flush_data(mCtx);
+    mFlushed = true;
+  }
+
+
+  // Decode all input that is available (the worker threads decode the slices in parallel).
+  // Pictures that are not taken here are returned by the following calls.
+
+  int more = 1;
+  while (more) {
+    more = 0;
+
+    de265_error err = de265_decode(mCtx, &more);
+    if (err == DE265_ERROR_WAITING_FOR_INPUT_DATA) {
+      break;
+    }
+    else if (!de265_isOK(err)) {
+      break; // decoding errors are concealed, continue with the next picture
+    }
+  }
+
+  *got_picture = outputPicture(frame);
+
+  return packet ? packet->size : 0;
+}
+
+
+bool LibDE265Backend::outputPicture(AVFrame* frame)
+{
+  const de265_image* img = de265_get_next_picture(mCtx);
+  if (!img) {
+    return false;
+  }
+
+  int bits = de265_get_bits_per_pixel(img, 0);
+
+  AVPixelFormat format;
+  switch (de265_get_chroma_format(img)) {
+  case de265_chroma_mono:
+    format = AV_PIX_FMT_GRAY8;
+    break;
+  case de265_chroma_420:
+    format = (bits>10 ? AV_PIX_FMT_YUV420P12 : bits>8 ? AV_PIX_FMT_YUV420P10 : AV_PIX_FMT_YUV420P);
+    break;
+  case de265_chroma_422:
+    format = (bits>10 ? AV_PIX_FMT_YUV422P12 : bits>8 ? AV_PIX_FMT_YUV422P10 : AV_PIX_FMT_YUV422P);
+    break;
+  case de265_chroma_444:
+  default:
+    format = (bits>10 ? AV_PIX_FMT_YUV444P12 : bits>8 ? AV_PIX_FMT_YUV444P10 : AV_PIX_FMT_YUV444P);
+    break;
+  }
+
+  if (format==AV_PIX_FMT_GRAY8 && bits>8) {
+    return false; // not supported
+  }
+
+  frame->format = format;
+  frame->width  = de265_get_image_width(img, 0);
+  frame->height = de265_get_image_height(img, 0);
+
+  if (av_frame_get_buffer(frame, 32) < 0) {
+    return false;
+  }
+
+  // libde265 reuses the image buffers, thus the planes are copied
+
+  int nPlanes = (format==AV_PIX_FMT_GRAY8 ? 1 : 3);
+  int bytesPerSample = (bits>8 ? 2 : 1);
+
+  for (int c=0;c<nPlanes;c++) {
+    int stride;
+    const uint8_t* plane = de265_get_image_plane(img, c, &stride);
+
+    av_image_copy_plane(frame->data[c], frame->linesize[c], plane, stride,
+                        de265_get_image_width(img, c) * bytesPerSample,
+                        de265_get_image_height(img, c));
+  }
+
+  frame->pts = frame->pkt_pts = de265_get_image_PTS(img);
+
+  return true;
+}
+
+
+void LibDE265Backend::flush()
+{
+  de265_reset(mCtx);
+
+  mFlushed = false;
+  mSkipUntilPTS = AV_NOPTS_VALUE;
+
+  pushParameterSets();
+}
+
+
+DecoderBackend* createLibDE265Backend(const AVCodecContext* ctx, int nThreads)
+{
+  LibDE265Backend* backend = new LibDE265Backend;
+
+  if (!backend->open(ctx, nThreads)) {
+    delete backend;
+    return NULL;
+  }
+
+  return backend;
+}
+
+#endif
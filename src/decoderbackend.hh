@@ -0,0 +1,76 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECODERBACKEND_HH
+#define DECODERBACKEND_HH
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavutil/avutil.h"
+}
+
+
+/* Video decoder used by the Decoder for its (sequential) decoding path. The
+   Decoder does the demuxing and frame indexing, the backend only turns packets
+   of the video stream into frames, with the same semantics as
+   avcodec_decode_video2(): at most one frame per call, 'frame' is unreferenced
+   first and gets refcounted buffers, and its pkt_pts is that of the packet.
+ */
+class DecoderBackend
+{
+public:
+  virtual ~DecoderBackend() { }
+
+  virtual const char* name() const = 0;
+
+  // Decode one packet. NULL drains the delayed frames at the end of the stream.
+  virtual int decode(AVFrame* frame, int* got_picture, const AVPacket* packet) = 0;
+
+  // Discard all pending data (after a seek).
+  virtual void flush() = 0;
+
+  /* Frames before this PTS are not needed by the caller, except as references
+     (while decoding forward to a seek target). Backends may skip decoding
+     frames that are not used as reference. Ends with the first packet at or
+     after the PTS, or with flush().
+   */
+  virtual void skipUntil(int64_t pts) { }
+};
+
+
+/* libavcodec, the default. The codec context (usually the one of the stream)
+   is opened here and closed with the backend. Returns NULL on error ('err').
+ */
+DecoderBackend* createLibAVCodecBackend(AVCodec* codec, AVCodecContext* ctx, int* err);
+
+#ifdef HAVE_LIBDE265
+/* libde265 for HEVC, decoding with 'nThreads' worker threads. Only the codec
+   parameters (extradata) are taken from 'ctx'. Returns NULL on error.
+ */
+DecoderBackend* createLibDE265Backend(const AVCodecContext* ctx, int nThreads);
+#endif
+
+#endif
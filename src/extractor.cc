@@ -18,411 +18,239 @@
  * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "decoder.hh"
+#include "keyframe.hh"
+#include "daemon.hh"
+#include "featurestore.hh"
+#include "json.hh"
 #include <vector>
-#include <algorithm>
-#include <libvideogfx.hh>
-#include "libcvalgo/histogram_diff.hh"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "cmdline.h"
 
-using namespace videogfx;
-
 struct gengetopt_args_info args_info;
 
 
-Image<Pixel> convertToImage(const AVFrame* avframe)
-{
-  Image<Pixel> img;
-  img.Create(avframe->width,
-             avframe->height,
-             Colorspace_YUV,
-             Chroma_420);
-
-  for (int y=0;y<avframe->height;y++)
-    memcpy(img.AskFrameY()[y], avframe->data[0] + avframe->linesize[0]*y, avframe->width);
-
-  for (int y=0;y<avframe->height/2;y++)
-    memcpy(img.AskFrameU()[y], avframe->data[1] + avframe->linesize[1]*y, avframe->width/2);
-
-  for (int y=0;y<avframe->height/2;y++)
-    memcpy(img.AskFrameV()[y], avframe->data[2] + avframe->linesize[2]*y, avframe->width/2);
-
-  return img;
-}
-
-double calcEntropy(const cvalgo::Histogram& p)
-{
-  double entropy = 0.0;
-  for (int i=0;i<256;i++)
-    if (p[i]!=0)
-      {
-        entropy += p[i] * -log2(p[i]);
-        //printf("p:%f e:%f\n",p[i],entropy);
-      }
-
-  return entropy;
-}
-
-cvalgo::Histogram calcHistogram(const Image<Pixel>& img, int channel)
+int main(int argc, char **argv)
 {
-  cvalgo::Histogram histogram;
-  histogram.Create(0,255);
-
-  Bitmap<Pixel> bm = img.AskBitmap((BitmapChannel)channel);
-  int w = bm.AskWidth();
-  int h = bm.AskHeight();
+  cmdline_parser(argc,argv,&args_info);
 
-  assert(w!=0 && h!=0);
+  if (args_info.inputs_num != (args_info.daemon_given ? 0 : 1)) {
+    cmdline_parser_print_help();
+    exit(0);
+  }
 
-  for (int y=0;y<h;y++)
-    for (int x=0;x<w;x++) {
-      histogram.Count( bm.AskFrame()[y][x] );
-    }
+  if (!args_info.daemon_given && !isValidOutputPattern(args_info.output_arg)) {
+    fprintf(stderr,"invalid output pattern (needs exactly one integer conversion, like %%02d): %s\n",
+            args_info.output_arg);
+    return 1;
+  }
 
-  histogram.Divide(histogram.TotalSum());
+  KeyframeOptions options;
+  options.number = args_info.number_arg;
+  options.candidates = args_info.candidates_arg;
+  options.decodeBudget = args_info.budget_arg;
+  options.randomSeed = (args_info.seed_given ? (uint64_t)args_info.seed_arg : (uint64_t)time(NULL));
 
-  return histogram;
-}
+  if (args_info.random_given) {
+    options.sampler = Sampler_Stratified;
+  }
 
+  if (args_info.sampler_given && !parseSamplerType(args_info.sampler_arg, options.sampler)) {
+    fprintf(stderr,"invalid sampler: %s\n", args_info.sampler_arg);
+    return 1;
+  }
 
-struct Candidate
-{
-  int64_t frameNr;
-  Image<Pixel> image;
-  cvalgo::Histogram histogram;
+  options.noseek = args_info.noseek_given;
+  options.decodeThreads = args_info.decode_threads_arg;
+  options.prefetch = args_info.prefetch_arg;
+  options.pipeline = args_info.pipeline_given;
+  options.analyzeThreads = args_info.analyze_threads_arg;
+  options.encodeThreads = args_info.encode_threads_arg;
+  options.deadline = args_info.deadline_arg;
+  options.rejectBlank = !args_info.keep_blank_given;
+  options.borderCropV = args_info.border_crop_v_given;
+  options.borderCropH = args_info.border_crop_h_given;
+  options.verbose = args_info.verbose_given;
+
+  if      (strcmp(args_info.io_arg, "mmap")==0) { options.ioMode = FileInput::IO_MMap; }
+  else if (strcmp(args_info.io_arg, "avio")==0) { options.ioMode = FileInput::IO_Default; }
+  else                                          { options.ioMode = FileInput::IO_Read; }
+
+  if      (strcmp(args_info.seek_mode_arg, "pts")==0)  { options.seekMode = Decoder::Seek_Timestamp; }
+  else if (strcmp(args_info.seek_mode_arg, "byte")==0) { options.seekMode = Decoder::Seek_Byte; }
+  else                                                 { options.seekMode = Decoder::Seek_Auto; }
+
+  if      (strcmp(args_info.decoder_arg, "libavcodec")==0) { options.decoderBackend = Decoder::Backend_LibAVCodec; }
+  else if (strcmp(args_info.decoder_arg, "libde265")==0)   { options.decoderBackend = Decoder::Backend_LibDE265; }
+  else                                                     { options.decoderBackend = Decoder::Backend_Auto; }
+
+  if (args_info.memory_limit_given && !parseByteSize(args_info.memory_limit_arg, options.memoryLimit)) {
+    fprintf(stderr,"invalid memory limit: %s\n", args_info.memory_limit_arg);
+    return 1;
+  }
 
-  int64_t pts;
-  double timestamp;
+  options.memoryPolicy = (strcmp(args_info.memory_policy_arg, "spill")==0 ?
+                          KeyframeOptions::Memory_Spill : KeyframeOptions::Memory_Drop);
 
-  double entropy;
-  double min_histogram_distance;
+  options.selection = (strcmp(args_info.selection_arg, "cluster")==0 ?
+                       KeyframeOptions::Selection_Cluster : KeyframeOptions::Selection_Greedy);
 
-  double score;
-};
+  if (args_info.start_given && !parsePosition(args_info.start_arg, options.rangeStart)) {
+    fprintf(stderr,"invalid start position: %s\n", args_info.start_arg);
+    return 1;
+  }
 
+  if (args_info.end_given && !parsePosition(args_info.end_arg, options.rangeEnd)) {
+    fprintf(stderr,"invalid end position: %s\n", args_info.end_arg);
+    return 1;
+  }
 
-void initRandomFrames(std::vector<Candidate>& candidates, int nFrames, int nCandidates)
-{
-  std::vector<int64_t> frames;
-  for (int i=0;i<nFrames;i++) frames.push_back(i);
-
-  while (candidates.size() < nCandidates) {
-    int i = rand() % frames.size();
-    int64_t f = frames[i];
-
-    Candidate c;
-    c.frameNr = f;
-    candidates.push_back(c);
-
-    frames[i] = frames.back();
-    frames.pop_back();
-
-    const int minDistance = nFrames / (nCandidates*4);
-    for (int i=0;i<frames.size();i++) {
-      if (abs(frames[i] - f) < minDistance) {
-        frames[i] = frames.back();
-        frames.pop_back();
-        i--;
-      }
+  if (args_info.aspect_crop_given) {
+    if (!parseAspect(args_info.aspect_crop_arg, options.aspectH, options.aspectV)) {
+      return 0;
     }
   }
-}
 
+  if (args_info.fast_open_given) {
+    options.probeSize = 1000000;
+    options.analyzeDuration = 1;
+  }
 
-int Sum(const Image<Pixel>& image, int x0,int y0, int x1,int y1)
-{
-  int sum=0;
+  if (args_info.probesize_given)       { options.probeSize = args_info.probesize_arg; }
+  if (args_info.analyzeduration_given) { options.analyzeDuration = args_info.analyzeduration_arg; }
 
-  for (int y=y0;y<y1;y++)
-    for (int x=x0;x<x1;x++) {
-      sum += image.AskFrameY()[y][x];
+  if (!args_info.daemon_given) {
+    if (args_info.index_cache_given) {
+      options.indexCache = (strcmp(args_info.index_cache_arg, "auto")==0 ?
+                            Decoder::defaultIndexCachePath(args_info.inputs[0]) :
+                            std::string(args_info.index_cache_arg));
     }
-
-  return sum;
-}
-
-float maxVBorderPercent = 0.25;
-float maxHBorderPercent = 0.15;
-int   aspect_mean_threshold = 50;
-
-void CropBordersV(std::vector<Candidate>& keyframes)
-{
-  int w = keyframes[0].image.AskWidth();
-  int h = keyframes[0].image.AskHeight();
-
-  int maxBorderWidth = h * maxVBorderPercent;
-  int borderWidth = 0;
-
-  for (int i=1;i<=maxBorderWidth;i++) {
-    int mean = 0;
-    for (auto c : keyframes) {
-      mean += Sum(c.image, 0,i-1, w-1,i) + Sum(c.image, 0,h-i, w-1,h-i+1);
+    else if (args_info.fast_open_given) {
+      options.indexCache = Decoder::defaultIndexCachePath(args_info.inputs[0]);
     }
-
-    mean /= 2*w*keyframes.size();
-
-    //int var2 = Var2(image, 0,0, i,h-1,mean) + Var2(image, w-maxBorderWidth,0, w,h-1,mean);
-    //var2 /= 2*i*h;
-
-    if (mean < aspect_mean_threshold)
-      borderWidth = i;
-    else
-      break;
   }
 
-
-  if (borderWidth > 0) {
-    for (auto& c : keyframes) {
-      Image<Pixel> cropped_img;
-      cropped_img.Create(w,h-2*borderWidth, Colorspace_YUV);
-      Crop(cropped_img, c.image, 0,0,borderWidth,borderWidth);
-      c.image = cropped_img;
-    }
+  if (args_info.features_given && !args_info.daemon_given) {
+    options.featureStore = (strcmp(args_info.features_arg, "auto")==0 ?
+                            defaultFeatureStorePath(args_info.inputs[0]) :
+                            std::string(args_info.features_arg));
+    options.refreshFeatures = args_info.refresh_features_given;
   }
-}
-
-
-void CropBordersH(std::vector<Candidate>& keyframes)
-{
-  int w = keyframes[0].image.AskWidth();
-  int h = keyframes[0].image.AskHeight();
-
-  int maxBorderWidth = w * maxHBorderPercent;
-  int borderWidth = 0;
 
-  for (int i=1;i<=maxBorderWidth;i++) {
-    int mean = 0;
-    for (auto c : keyframes) {
-      mean += Sum(c.image, i-1,0, i,h-1) + Sum(c.image, w-i,0, w-i+1,h-1);
+  SignatureIndex signatureIndex;
+  if (args_info.signature_index_given) {
+    if (!signatureIndex.open(args_info.signature_index_arg)) {
+      fprintf(stderr, "cannot open signature index %s\n", args_info.signature_index_arg);
+      return 1;
     }
 
-    mean /= 2*h*keyframes.size();
-
-    //int var2 = Var2(image, 0,0, i,h-1,mean) + Var2(image, w-maxBorderWidth,0, w,h-1,mean);
-    //var2 /= 2*i*h;
-
-    if (mean < aspect_mean_threshold)
-      borderWidth = i;
-    else
-      break;
+    signatureIndex.setMinVideos(args_info.boilerplate_videos_arg);
+    options.signatureIndex = &signatureIndex;
   }
 
+  if (args_info.daemon_given) {
+    DaemonConfig config;
+    config.socketPath = (strcmp(args_info.daemon_arg, "-")==0 ? "" : args_info.daemon_arg);
+    config.nWorkers = args_info.jobs_arg;
+    config.maxQueue = args_info.max_queue_arg;
+    config.defaults = options;
 
-  if (borderWidth > 0) {
-    for (auto& c : keyframes) {
-      Image<Pixel> cropped_img;
-      cropped_img.Create(w-2*borderWidth,h, Colorspace_YUV);
-      Crop(cropped_img, c.image, borderWidth,borderWidth,0,0);
-      c.image = cropped_img;
-    }
+    return runDaemon(config);
   }
-}
 
-
-bool AspectCrop(Image<Pixel>& image)
-{
-  int aspect_h;
-  int aspect_v;
-
-  std::string aspect = args_info.aspect_crop_arg;
-  size_t pos = aspect.find(':');
-  if (pos == std::string::npos) {
-    fprintf(stderr,"aspect option has wrong format\n");
-    return false;
+  Statistics stats;
+  if (args_info.stats_given || args_info.pipeline_given) {
+    options.stats = &stats;
   }
 
-  std::string aspect_h_str = aspect.substr(0,pos);
-  std::string aspect_v_str = aspect.substr(pos+1);
 
-  aspect_h = atoi(aspect_h_str.c_str());
-  aspect_v = atoi(aspect_v_str.c_str());
+  KeyframeExtractor extractor;
+  std::vector<Keyframe> keyframes;
 
-  if (aspect_h<=0 || aspect_v<=0) {
-    fprintf(stderr,"aspects must be > 0\n");
-    return false;
-  }
 
+  // JSON lines mode: write each keyframe as soon as it is available and describe it on stdout
 
-  int crop_width  = image.AskWidth();
-  int crop_height = image.AskHeight();
+  bool writeFailed = false;
 
-  // --- try horizontal fit ---
+  if (args_info.json_lines_given) {
+    options.verbose = false; // stdout is for the records
 
-  int hfit_height = image.AskWidth()*aspect_v/aspect_h;
-  if (hfit_height <= image.AskHeight()) {
-    crop_height = hfit_height;
-  }
-  else {
-    // --- try vertical fit ---
+    options.onKeyframe = [&](const Keyframe& k, int rank) {
+      std::string filename;
+      if (!writeKeyframeFile(k, args_info.output_arg, rank, &filename)) {
+        writeFailed = true;
+        return;
+      }
 
-    int vfit_width = image.AskHeight()*aspect_h/aspect_v;
-    assert(vfit_width <= image.AskWidth());
-    crop_width = vfit_width;
+      printf("{\"rank\": %d, \"frame_number\": %lld, \"pts\": %lld, \"timestamp\": %f, "
+             "\"entropy\": %f, \"min_histogram_distance\": %f, \"score\": %f, \"path\": %s}\n",
+             rank, (long long)k.frameNr, (long long)k.pts, k.timestamp,
+             k.entropy, k.min_histogram_distance, k.score, jsonString(filename).c_str());
+      fflush(stdout);
+    };
   }
 
-  Image<Pixel> cropped_img;
-  cropped_img.Create(crop_width, crop_height, Colorspace_YUV);
-  Crop(cropped_img, image,
-       (image.AskWidth() - crop_width) / 2,
-       image.AskWidth()-crop_width - (image.AskWidth() - crop_width) / 2,
-       (image.AskHeight() - crop_height) / 2,
-       image.AskHeight()-crop_height - (image.AskHeight() - crop_height) / 2);
-
-  image = cropped_img;
-
-  return true;
-}
-
-
-int main(int argc, char **argv)
-{
-  srand(time(NULL));
-
-  cmdline_parser(argc,argv,&args_info);
-
-  if (args_info.inputs_num != 1) {
-    cmdline_parser_print_help();
-    exit(0);
+  if (extractor.extract(args_info.inputs[0], options, keyframes) != 0) {
+    fprintf(stderr, "cannot load video %s\n", args_info.inputs[0]);
+    return 1;
   }
 
-  // --- init video decoder ---
-
-  Decoder decoder;
-  decoder.loadMovie(args_info.inputs[0]);
 
-
-  // --- initial set of candidates ---
-
-  std::vector<Candidate> candidates;
-  int nCandidates = args_info.candidates_arg;
-  const int CANDIDATES_REDUNDANCY = 2;
-  if (nCandidates==0) { nCandidates=args_info.number_arg * CANDIDATES_REDUNDANCY; }
-
-  int64_t nFrames = decoder.getNFrames();
-
-  if (args_info.random_given) {
-    initRandomFrames(candidates, nFrames, nCandidates);
-  }
-  else {
-    for (int i=0;i<nCandidates;i++) {
-      Candidate c;
-      c.frameNr = (i+1)*nFrames/(nCandidates+1);
-      candidates.push_back(c);
+  if (args_info.json_lines_given) {
+    if (writeFailed) {
+      return 1;
     }
   }
-
-#if 1
-  // --- load video frames ---
-
-  std::sort(candidates.begin(),
-            candidates.end(),
-            [](const Candidate& a, const Candidate& b) { return a.frameNr < b.frameNr; });
-
-  int frameNr = -1;
-
-  for (Candidate& c : candidates) {
-    if (args_info.verbose_given) { printf("loading candidate frame %ld\n", c.frameNr); }
-
-    AVFrame* frame = NULL;
-    if (!args_info.noseek_given) {
-      decoder.seekToFrame(c.frameNr);
-      frame = decoder.getVideoFrame();
-    }
-    else {
-      while (frameNr < c.frameNr) {
-        frame = decoder.getVideoFrame();
-        frameNr++;
-        decoder.seekToNextVideoFrame();
-      }
-    }
-
-    c.pts = decoder.getFramePTS(c.frameNr);
-    c.timestamp = decoder.PTS2Time(c.pts);
-
-
-    Image<Pixel> img = convertToImage(frame);
-    c.image = img;
-
-    c.histogram = calcHistogram(img,0);
-    c.entropy = calcEntropy(c.histogram);
+  else if (!writeKeyframeFiles(keyframes, args_info.output_arg)) {
+    return 1;
   }
 
+  if (args_info.deadline_given) {
+    fprintf(stderr, "evaluated %d candidates%s\n", extractor.getNumEvaluatedCandidates(),
+            extractor.wasDeadlineReached() ? " (deadline reached)" : "");
+  }
 
-
-  // --- save best images ---
-
-  std::vector<Candidate> keyframes;
-
-  while (!candidates.empty()) {
-
-    // --- compute min. distance to selected keyframes ---
-
-    for (Candidate& c : candidates) {
-      cvalgo::HistogramDiff_AbsoluteError histDiff;
-
-      double minDist = 1.0;
-      for (Candidate& k : keyframes) {
-        double dist = histDiff.Diff(k.histogram, c.histogram);
-        if (dist<minDist) minDist=dist;
+  if (args_info.pipeline_given) {
+    fprintf(stderr, "pipeline utilization:");
+    for (int i=0;i<Statistics::NumPipelineStages;i++) {
+      Statistics::PipelineStage stage = (Statistics::PipelineStage)i;
+      if (stats.getPipelineThreads(stage) > 0) {
+        fprintf(stderr, " %s %.0f%% (%d threads)", Statistics::pipelineStageName(stage),
+                stats.getPipelineUtilization(stage)*100, stats.getPipelineThreads(stage));
       }
-
-      c.min_histogram_distance = minDist;
-    }
-
-
-    // --- compute score ---
-
-    for (Candidate& c : candidates) {
-      c.score = c.entropy + c.min_histogram_distance;
     }
-
-    std::sort(candidates.begin(),
-              candidates.end(),
-              [](const Candidate& a, const Candidate& b) { return a.score < b.score; });
-
-
-    Candidate c = candidates.back();
-    keyframes.push_back(c);
-    candidates.pop_back();
+    fprintf(stderr, "\n");
   }
 
-
-  if (args_info.border_crop_v_given) {
-    CropBordersV(keyframes);
+  if (args_info.fast_open_given || args_info.index_cache_given ||
+      args_info.probesize_given || args_info.analyzeduration_given) {
+    fprintf(stderr, "opened in %.1f ms%s\n", extractor.getOpenTime()*1000,
+            extractor.usedIndexCache() ? " (cached index)" : "");
   }
 
-  if (args_info.border_crop_h_given) {
-    CropBordersH(keyframes);
+  if (options.verbose) {
+    for (const auto& k : keyframes) {
+      printf("frame-number: %lld  PTS: %lld  timestamp: %lf\n", k.frameNr, k.pts, k.timestamp);
+    }
   }
 
 
-  int cnt=1;
-  for (auto c : keyframes) {
-    bool save = (cnt <= args_info.number_arg);
-
-    if (args_info.verbose_given) {
-      printf("%2d%c: #=%5ld E=%f hd=%f\n",cnt, save ? '*':' ', c.frameNr, c.entropy, c.min_histogram_distance);
+  if (args_info.stats_given) {
+    if (strcmp(args_info.stats_arg, "-")==0) {
+      stats.writeJSON(stdout, args_info.inputs[0]);
     }
-
-    if (save) {
-      if (args_info.aspect_crop_given) {
-        if (!AspectCrop(c.image)) {
-          return 0;
-        }
+    else {
+      FILE* fh = fopen(args_info.stats_arg, "w");
+      if (fh==NULL) {
+        fprintf(stderr, "cannot write statistics to %s\n", args_info.stats_arg);
+        return 1;
       }
 
-      char name[100];
-      sprintf(name, args_info.output_arg ,cnt);
-      WriteImage_JPEG(name, c.image);
-
-      if (args_info.verbose_given) {
-        printf("frame-number: %lld  PTS: %lld  timestamp: %lf\n", c.frameNr, c.pts, c.timestamp);
-      }
+      stats.writeJSON(fh, args_info.inputs[0]);
+      fclose(fh);
     }
-
-    cnt++;
   }
-#endif
 
   return 0;
 }
@@ -0,0 +1,485 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "features.hh"
+extern "C" {
+#include "libavutil/imgutils.h"
+}
+#include <assert.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+using namespace videogfx;
+
+
+// --- pixel format traits ---
+
+/* T:          sample type
+   Shift:      right shift to reduce a sample to 8 bit
+   Log2ChromaW/H: chroma subsampling
+   Interleaved:   chroma stored as interleaved UV pairs in data[1] (NV12 style)
+   SwapUV:        interleaved as VU (NV21)
+ */
+template <class T, int Shift, int Log2ChromaW, int Log2ChromaH,
+          bool Interleaved=false, bool SwapUV=false>
+struct PixFmt
+{
+  typedef T sample_t;
+
+  enum { log2ChromaW = Log2ChromaW,
+         log2ChromaH = Log2ChromaH };
+
+  static inline int to8(T v) { return v >> Shift; }
+
+  static inline const T* lumaRow(const AVFrame* f, int y)
+  {
+    return (const T*)(f->data[0] + f->linesize[0]*y);
+  }
+
+  // comp: 0=U, 1=V
+  static inline int chroma(const AVFrame* f, int comp, int cx, int cy)
+  {
+    if (Interleaved) {
+      const T* row = (const T*)(f->data[1] + f->linesize[1]*cy);
+      return row[2*cx + (comp ^ (SwapUV ? 1:0))];
+    }
+    else {
+      const T* row = (const T*)(f->data[1+comp] + f->linesize[1+comp]*cy);
+      return row[cx];
+    }
+  }
+};
+
+
+typedef PixFmt<uint8_t, 0, 1,1>  Fmt_420_8;
+typedef PixFmt<uint8_t, 0, 1,0>  Fmt_422_8;
+typedef PixFmt<uint8_t, 0, 0,0>  Fmt_444_8;
+typedef PixFmt<uint16_t,2, 1,1>  Fmt_420_10;
+typedef PixFmt<uint16_t,2, 1,0>  Fmt_422_10;
+typedef PixFmt<uint16_t,2, 0,0>  Fmt_444_10;
+typedef PixFmt<uint16_t,4, 1,1>  Fmt_420_12;
+typedef PixFmt<uint16_t,4, 1,0>  Fmt_422_12;
+typedef PixFmt<uint16_t,4, 0,0>  Fmt_444_12;
+typedef PixFmt<uint8_t, 0, 1,1, true>       Fmt_NV12;
+typedef PixFmt<uint8_t, 0, 1,1, true, true> Fmt_NV21;
+typedef PixFmt<uint16_t,8, 1,1, true>       Fmt_P010; // 10 bit in the MSBs
+
+
+/* Call the templated kernel.apply<Format>() that matches the frame pixel format.
+   Returns false if the format is not supported.
+ */
+template <class Kernel> bool dispatchPixelFormat(int format, Kernel& kernel)
+{
+  switch (format) {
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_YUVJ420P:   kernel.template apply<Fmt_420_8>();  return true;
+  case AV_PIX_FMT_YUV422P:
+  case AV_PIX_FMT_YUVJ422P:   kernel.template apply<Fmt_422_8>();  return true;
+  case AV_PIX_FMT_YUV444P:
+  case AV_PIX_FMT_YUVJ444P:   kernel.template apply<Fmt_444_8>();  return true;
+  case AV_PIX_FMT_YUV420P10:  kernel.template apply<Fmt_420_10>(); return true;
+  case AV_PIX_FMT_YUV422P10:  kernel.template apply<Fmt_422_10>(); return true;
+  case AV_PIX_FMT_YUV444P10:  kernel.template apply<Fmt_444_10>(); return true;
+  case AV_PIX_FMT_YUV420P12:  kernel.template apply<Fmt_420_12>(); return true;
+  case AV_PIX_FMT_YUV422P12:  kernel.template apply<Fmt_422_12>(); return true;
+  case AV_PIX_FMT_YUV444P12:  kernel.template apply<Fmt_444_12>(); return true;
+  case AV_PIX_FMT_NV12:       kernel.template apply<Fmt_NV12>();   return true;
+  case AV_PIX_FMT_NV21:       kernel.template apply<Fmt_NV21>();   return true;
+#ifdef AV_PIX_FMT_P010
+  case AV_PIX_FMT_P010:       kernel.template apply<Fmt_P010>();   return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+
+struct NoKernel
+{
+  template <class F> void apply() { }
+};
+
+
+bool isNativePixelFormat(int format)
+{
+  NoKernel k;
+  return dispatchPixelFormat(format, k);
+}
+
+
+// --- frame references ---
+
+static void freeFrame(AVFrame* frame)
+{
+  av_frame_free(&frame);
+}
+
+
+FramePtr makeFramePtr(AVFrame* frame)
+{
+  return FramePtr(frame, freeFrame);
+}
+
+
+int64_t frameBytes(const AVFrame* frame)
+{
+  return av_image_get_buffer_size((enum AVPixelFormat)frame->format,
+                                  frame->width, frame->height, 1);
+}
+
+
+FramePtr referenceFrame(const AVFrame* frame, struct SwsContext** fallbackScaler)
+{
+  if (frame==NULL) {
+    return FramePtr();
+  }
+
+  if (isNativePixelFormat(frame->format)) {
+    return FramePtr(av_frame_clone(frame), freeFrame);
+  }
+
+  AVFrame* converted = av_frame_alloc();
+  converted->format = AV_PIX_FMT_YUV420P;
+  converted->width  = frame->width;
+  converted->height = frame->height;
+  converted->pts     = frame->pts;
+  converted->pkt_pts = frame->pkt_pts;
+  converted->pkt_dts = frame->pkt_dts;
+
+  if (av_frame_get_buffer(converted, 32) < 0) {
+    av_frame_free(&converted);
+    return FramePtr();
+  }
+
+  *fallbackScaler = sws_getCachedContext(*fallbackScaler,
+                                         frame->width, frame->height,
+                                         (enum AVPixelFormat)frame->format,
+                                         frame->width, frame->height,
+                                         AV_PIX_FMT_YUV420P,
+                                         SWS_BILINEAR, NULL,NULL,NULL);
+
+  if (*fallbackScaler==NULL) { // swscale cannot convert this format either
+    av_frame_free(&converted);
+    return FramePtr();
+  }
+
+  sws_scale(*fallbackScaler,
+            frame->data, frame->linesize, 0, frame->height,
+            converted->data, converted->linesize);
+
+  return FramePtr(converted, freeFrame);
+}
+
+
+// --- kernels ---
+
+struct HistogramKernel
+{
+  const AVFrame* frame;
+  int bins[256];
+
+  template <class F> void apply()
+  {
+    for (int i=0;i<256;i++) bins[i]=0;
+
+    for (int y=0;y<frame->height;y++) {
+      const typename F::sample_t* row = F::lumaRow(frame,y);
+      for (int x=0;x<frame->width;x++) {
+        bins[F::to8(row[x])]++;
+      }
+    }
+  }
+};
+
+
+cvalgo::Histogram calcHistogram(const AVFrame* frame)
+{
+  assert(frame->width!=0 && frame->height!=0);
+
+  HistogramKernel kernel;
+  kernel.frame = frame;
+
+  cvalgo::Histogram histogram;
+  histogram.Create(0,255);
+
+  if (!dispatchPixelFormat(frame->format, kernel)) {
+    return histogram; // empty
+  }
+
+  for (int i=0;i<256;i++)
+    if (kernel.bins[i]) {
+      histogram.Count(i, kernel.bins[i]);
+    }
+
+  histogram.Divide(histogram.TotalSum());
+
+  return histogram;
+}
+
+
+double calcEntropy(const cvalgo::Histogram& p)
+{
+  double entropy = 0.0;
+  for (int i=0;i<256;i++)
+    if (p[i]!=0)
+      {
+        entropy += p[i] * -log2(p[i]);
+        //printf("p:%f e:%f\n",p[i],entropy);
+      }
+
+  return entropy;
+}
+
+
+struct SparseStatsKernel
+{
+  const AVFrame* frame;
+  int    step;
+  int    darkLevel;
+
+  int    nSamples;
+  int    nDark;
+  double sum, sum2;
+
+  template <class F> void apply()
+  {
+    nSamples = nDark = 0;
+    sum = sum2 = 0;
+
+    for (int y=step/2;y<frame->height;y+=step) {
+      const typename F::sample_t* row = F::lumaRow(frame,y);
+      for (int x=step/2;x<frame->width;x+=step) {
+        int v = F::to8(row[x]);
+        sum  += v;
+        sum2 += v*v;
+        if (v < darkLevel) nDark++;
+        nSamples++;
+      }
+    }
+  }
+};
+
+
+bool isBlankFrame(const AVFrame* frame)
+{
+  const double minStdDev = 5.0;         // below: (nearly) uniform color
+  const double maxDarkFraction = 0.98;  // above: black frame, e.g. in a fade
+
+  SparseStatsKernel kernel;
+  kernel.frame = frame;
+  kernel.step = 8;
+  kernel.darkLevel = 24;
+
+  if (!dispatchPixelFormat(frame->format, kernel)) {
+    return true; // cannot be analyzed
+  }
+
+  if (kernel.nSamples==0) {
+    return true;
+  }
+
+  double mean = kernel.sum / kernel.nSamples;
+  double var  = kernel.sum2 / kernel.nSamples - mean*mean;
+
+  return (var < minStdDev*minStdDev ||
+          kernel.nDark > maxDarkFraction * kernel.nSamples);
+}
+
+
+struct DHashKernel
+{
+  const AVFrame* frame;
+  int sum[8][9];
+  int cnt[8][9];
+
+  template <class F> void apply()
+  {
+    memset(sum,0,sizeof(sum));
+    memset(cnt,0,sizeof(cnt));
+
+    // every second pixel in every second row is sufficient for the block means
+
+    std::vector<int> cellX;
+    for (int x=0;x<frame->width;x+=2) {
+      cellX.push_back(x*9/frame->width);
+    }
+
+    for (int y=0;y<frame->height;y+=2) {
+      const typename F::sample_t* row = F::lumaRow(frame,y);
+      int cy = y*8/frame->height;
+
+      for (size_t i=0;i<cellX.size();i++) {
+        sum[cy][cellX[i]] += F::to8(row[2*i]);
+        cnt[cy][cellX[i]]++;
+      }
+    }
+  }
+};
+
+
+uint64_t calcDHash(const AVFrame* frame)
+{
+  DHashKernel kernel;
+  kernel.frame = frame;
+
+  if (!dispatchPixelFormat(frame->format, kernel)) {
+    return 0;
+  }
+
+  uint64_t hash = 0;
+
+  for (int y=0;y<8;y++)
+    for (int x=0;x<8;x++) {
+      // compare the means sum/cnt of both blocks without division
+      int64_t left  = (int64_t)kernel.sum[y][x  ] * kernel.cnt[y][x+1];
+      int64_t right = (int64_t)kernel.sum[y][x+1] * kernel.cnt[y][x  ];
+
+      if (left > right) {
+        hash |= UINT64_C(1) << (y*8+x);
+      }
+    }
+
+  return hash;
+}
+
+
+struct ProjectionKernel
+{
+  const AVFrame* frame;
+  std::vector<int> rowSums;
+  std::vector<int> colSums;
+  int colY0, colY1;
+
+  template <class F> void apply()
+  {
+    rowSums.assign(frame->height, 0);
+    colSums.assign(frame->width, 0);
+
+    for (int y=0;y<frame->height;y++) {
+      const typename F::sample_t* row = F::lumaRow(frame,y);
+
+      int sum=0;
+      for (int x=0;x<frame->width;x++) {
+        sum += F::to8(row[x]);
+      }
+      rowSums[y] = sum;
+
+      if (y>=colY0 && y<colY1) {
+        for (int x=0;x<frame->width;x++) {
+          colSums[x] += F::to8(row[x]);
+        }
+      }
+    }
+  }
+};
+
+
+void calcProjections(const AVFrame* frame,
+                     std::vector<uint8_t>& rowMeans,
+                     std::vector<uint8_t>& colMeans)
+{
+  ProjectionKernel kernel;
+  kernel.frame = frame;
+  kernel.colY0 = frame->height/4;
+  kernel.colY1 = frame->height - frame->height/4;
+
+  if (!dispatchPixelFormat(frame->format, kernel)) {
+    rowMeans.assign(frame->height, 255); // no borders
+    colMeans.assign(frame->width,  255);
+    return;
+  }
+
+  int nColRows = std::max(kernel.colY1 - kernel.colY0, 1);
+
+  rowMeans.resize(frame->height);
+  for (int y=0;y<frame->height;y++) {
+    rowMeans[y] = kernel.rowSums[y] / frame->width;
+  }
+
+  colMeans.resize(frame->width);
+  for (int x=0;x<frame->width;x++) {
+    colMeans[x] = kernel.colSums[x] / nColRows;
+  }
+}
+
+
+struct ConvertKernel
+{
+  const AVFrame* frame;
+  int x0,y0,w,h;
+  Image<Pixel> image;
+
+  template <class F> void apply()
+  {
+    image.Create(w,h, Colorspace_YUV, Chroma_420);
+
+    for (int y=0;y<h;y++) {
+      const typename F::sample_t* src = F::lumaRow(frame,y0+y) + x0;
+      Pixel* dst = image.AskFrameY()[y];
+      for (int x=0;x<w;x++) {
+        dst[x] = F::to8(src[x]);
+      }
+    }
+
+
+    // Each output chroma sample covers 2x2 luma samples. Average over all
+    // input chroma samples within that area.
+
+    const int nx = 2 >> F::log2ChromaW;
+    const int ny = 2 >> F::log2ChromaH;
+    const int shift = (2-F::log2ChromaW) + (2-F::log2ChromaH) - 2;
+
+    for (int comp=0;comp<2;comp++) {
+      Pixel*const* dst = (comp==0 ? image.AskFrameU() : image.AskFrameV());
+
+      for (int y=0;y<h/2;y++)
+        for (int x=0;x<w/2;x++) {
+          int cx = (x0+2*x) >> F::log2ChromaW;
+          int cy = (y0+2*y) >> F::log2ChromaH;
+
+          int sum=0;
+          for (int dy=0;dy<ny;dy++)
+            for (int dx=0;dx<nx;dx++) {
+              sum += F::to8(F::chroma(frame, comp, cx+dx, cy+dy));
+            }
+
+          dst[y][x] = (sum + ((1<<shift)>>1)) >> shift;
+        }
+    }
+  }
+};
+
+
+Image<Pixel> convertToImage(const AVFrame* frame, const CropRect& crop)
+{
+  ConvertKernel kernel;
+  kernel.frame = frame;
+  kernel.x0 = (crop.left+1) & ~1;
+  kernel.y0 = (crop.top +1) & ~1;
+  kernel.w  = (frame->width  - kernel.x0 - crop.right ) & ~1;
+  kernel.h  = (frame->height - kernel.y0 - crop.bottom) & ~1;
+
+  if (!dispatchPixelFormat(frame->format, kernel)) {
+    return Image<Pixel>();
+  }
+
+  return kernel.image;
+}
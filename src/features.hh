@@ -0,0 +1,108 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FEATURES_HH
+#define FEATURES_HH
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <memory>
+#include <vector>
+#include <libvideogfx.hh>
+#include "libcvalgo/histogram.hh"
+
+extern "C" {
+#include "libavutil/avutil.h"
+#include <libswscale/swscale.h>
+}
+
+
+/* Feature computation directly on the decoded AVFrame planes.
+
+   Supported are 8, 10 and 12 bit planar YUV with 4:2:0, 4:2:2 and 4:4:4 chroma,
+   as well as the semi-planar NV12/NV21 (and P010) layouts. All values are scaled
+   to 8 bit, such that the results do not depend on the source format.
+   Frames in other formats (see referenceFrame()) give empty results: an empty
+   histogram and image, bright projections (no borders), a zero hash, and they
+   count as blank.
+ */
+
+
+typedef std::shared_ptr<AVFrame> FramePtr;
+
+
+/* Crop region, given as the number of pixels removed at each image border.
+   Crops are only accumulated here and applied once when the image is written.
+ */
+struct CropRect
+{
+  int left,right,top,bottom;
+
+  CropRect() : left(0),right(0),top(0),bottom(0) { }
+};
+
+
+bool isNativePixelFormat(int format);
+
+// Take ownership of the frame (freed with av_frame_free()).
+FramePtr makeFramePtr(AVFrame* frame);
+
+// Size of the pixel data of the frame, without padding.
+int64_t frameBytes(const AVFrame* frame);
+
+/* Get a new reference to the frame data (no pixel copy). Frames in formats not
+   supported natively are converted once to 8-bit YUV 4:2:0 using swscale.
+   Returns an empty pointer if the frame cannot be converted; the candidate is
+   then skipped like an undecodable frame.
+ */
+FramePtr referenceFrame(const AVFrame* frame, struct SwsContext** fallbackScaler);
+
+// Histogram of the luma channel (256 bins, normalized to a total sum of 1).
+cvalgo::Histogram calcHistogram(const AVFrame* frame);
+
+double calcEntropy(const cvalgo::Histogram& p);
+
+/* Cheap test for black, blank or near-uniform frames on a sparse grid of luma
+   samples (about 1/64 of the pixels).
+ */
+bool isBlankFrame(const AVFrame* frame);
+
+/* 64-bit difference hash of the luma plane: the image is reduced to 9x8 block
+   means and each bit tells whether a block is brighter than its right neighbor.
+   Similar images have a small Hamming distance between their hashes.
+ */
+uint64_t calcDHash(const AVFrame* frame);
+
+/* Mean luma of each row (over the full width) and of each column (over the
+   central half of the rows, which is never cut off by vertical border cropping).
+   Used for border detection.
+ */
+void calcProjections(const AVFrame* frame,
+                     std::vector<uint8_t>& rowMeans,
+                     std::vector<uint8_t>& colMeans);
+
+/* Convert the cropped frame area to an 8-bit 4:2:0 image. Crop offsets and sizes
+   are rounded to even values to keep the chroma aligned.
+ */
+videogfx::Image<videogfx::Pixel> convertToImage(const AVFrame* frame, const CropRect& crop);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "featurestore.hh"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static const char StoreMagic[8] = { 'K','F','F','E','A','T','U','R' };
+static const uint32_t StoreVersion = 2;
+
+struct StoreHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t nCandidates;
+  int64_t  videoSize;
+  int64_t  videoMTime;
+  int32_t  width, height;
+  uint32_t recordSize;
+  uint32_t complete;
+
+  // parameters the candidates were computed with
+
+  int64_t  rangeBeginPTS;
+  int64_t  rangeLastPTS;
+  uint64_t randomSeed;
+  uint32_t sampler;
+  int32_t  candidates;
+  int32_t  decodeBudget;
+  uint32_t rejectBlank;
+};
+
+/* Record layout:
+     int64_t frameNr, pts
+     double  timestamp, entropy
+     uint64_t dhash
+     float   histogram[256]
+     uint8_t rowMeans[height], colMeans[width]
+   padded to a multiple of 8 bytes.
+ */
+
+struct StoreRecord
+{
+  int64_t  frameNr;
+  int64_t  pts;
+  double   timestamp;
+  double   entropy;
+  uint64_t dhash;
+  float    histogram[256];
+  // followed by the projections
+};
+
+
+static size_t recordSize(int width, int height)
+{
+  return (sizeof(StoreRecord) + width + height + 7) & ~7;
+}
+
+
+static bool videoFileInfo(const char* videoFilename, int64_t& size, int64_t& mtime)
+{
+  struct stat st;
+  if (stat(videoFilename, &st)<0) {
+    return false;
+  }
+
+  size  = st.st_size;
+  mtime = st.st_mtime;
+  return true;
+}
+
+
+std::string defaultFeatureStorePath(const char* videoFilename)
+{
+  return std::string(videoFilename) + ".features";
+}
+
+
+bool writeFeatureStore(const char* filename, const char* videoFilename,
+                       const FeatureStoreParams& params,
+                       const std::vector<Candidate>& candidates)
+{
+  if (candidates.empty()) {
+    return false;
+  }
+
+  // all records have the size of the first candidate
+
+  for (const auto& c : candidates) {
+    if (c.width != candidates[0].width || c.height != candidates[0].height ||
+        c.rowMeans.size() != (size_t)c.height || c.colMeans.size() != (size_t)c.width) {
+      return false;
+    }
+  }
+
+  StoreHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, StoreMagic, sizeof(StoreMagic));
+  header.version = StoreVersion;
+  header.nCandidates = candidates.size();
+  header.width  = candidates[0].width;
+  header.height = candidates[0].height;
+  header.recordSize = recordSize(header.width, header.height);
+  header.complete   = params.complete;
+
+  header.rangeBeginPTS = params.rangeBeginPTS;
+  header.rangeLastPTS  = params.rangeLastPTS;
+  header.randomSeed    = params.randomSeed;
+  header.sampler       = params.sampler;
+  header.candidates    = params.candidates;
+  header.decodeBudget  = params.decodeBudget;
+  header.rejectBlank   = params.rejectBlank;
+
+  if (!videoFileInfo(videoFilename, header.videoSize, header.videoMTime)) {
+    return false;
+  }
+
+
+  // write to a temporary file and rename, such that readers never see a partial store
+
+  std::string tmpName = std::string(filename) + ".tmp";
+
+  FILE* fh = fopen(tmpName.c_str(), "wb");
+  if (fh==NULL) {
+    return false;
+  }
+
+  bool ok = (fwrite(&header, sizeof(header), 1, fh) == 1);
+
+  std::vector<uint8_t> record(header.recordSize);
+
+  for (const auto& c : candidates) {
+    memset(record.data(), 0, record.size());
+
+    StoreRecord* r = (StoreRecord*)record.data();
+    r->frameNr   = c.frameNr;
+    r->pts       = c.pts;
+    r->timestamp = c.timestamp;
+    r->entropy   = c.entropy;
+    r->dhash     = c.dhash;
+
+    for (int i=0;i<256;i++) {
+      r->histogram[i] = c.histogram[i];
+    }
+
+    uint8_t* p = record.data() + sizeof(StoreRecord);
+    memcpy(p, c.rowMeans.data(), header.height);
+    memcpy(p+header.height, c.colMeans.data(), header.width);
+
+    ok = ok && (fwrite(record.data(), record.size(), 1, fh) == 1);
+  }
+
+  ok = (fclose(fh)==0) && ok;
+  ok = ok && (rename(tmpName.c_str(), filename) == 0);
+
+  if (!ok) {
+    unlink(tmpName.c_str());
+  }
+
+  return ok;
+}
+
+
+bool readFeatureStore(const char* filename, const char* videoFilename,
+                      const FeatureStoreParams& params,
+                      std::vector<Candidate>& candidates)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd<0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)<0 || st.st_size < (off_t)sizeof(StoreHeader)) {
+    close(fd);
+    return false;
+  }
+
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  const StoreHeader* header = (const StoreHeader*)map;
+
+  int64_t videoSize, videoMTime;
+
+  bool ok = (memcmp(header->magic, StoreMagic, sizeof(StoreMagic))==0 &&
+             header->version == StoreVersion &&
+             header->width > 0 && header->height > 0 &&
+             header->recordSize == recordSize(header->width, header->height) &&
+             (uint64_t)st.st_size >= sizeof(StoreHeader) + (uint64_t)header->nCandidates*header->recordSize &&
+             videoFileInfo(videoFilename, videoSize, videoMTime) &&
+             videoSize == header->videoSize &&
+             videoMTime == header->videoMTime &&
+             header->complete &&
+             header->rangeBeginPTS == params.rangeBeginPTS &&
+             header->rangeLastPTS  == params.rangeLastPTS &&
+             header->randomSeed    == params.randomSeed &&
+             header->sampler       == params.sampler &&
+             header->candidates    == params.candidates &&
+             header->decodeBudget  == params.decodeBudget &&
+             header->rejectBlank   == (uint32_t)params.rejectBlank);
+
+  if (ok) {
+    const uint8_t* data = (const uint8_t*)(header+1);
+
+    for (uint32_t i=0;i<header->nCandidates;i++) {
+      const StoreRecord* r = (const StoreRecord*)(data + i*header->recordSize);
+      const uint8_t* p = (const uint8_t*)(r+1);
+
+      Candidate c;
+      c.frameNr   = r->frameNr;
+      c.pts       = r->pts;
+      c.timestamp = r->timestamp;
+      c.entropy   = r->entropy;
+      c.dhash     = r->dhash;
+      c.width     = header->width;
+      c.height    = header->height;
+
+      c.histogram.Create(0,255);
+      for (int b=0;b<256;b++) {
+        if (r->histogram[b] != 0) {
+          c.histogram.Count(b, r->histogram[b]);
+        }
+      }
+
+      c.rowMeans.assign(p, p+header->height);
+      c.colMeans.assign(p+header->height, p+header->height+header->width);
+
+      candidates.push_back(c);
+    }
+  }
+
+  munmap(map, st.st_size);
+
+  return ok;
+}
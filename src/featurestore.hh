@@ -0,0 +1,68 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FEATURESTORE_HH
+#define FEATURESTORE_HH
+
+#include <vector>
+#include <string>
+#include "selection.hh"
+
+
+/* Per-video store of the candidate features (frame number, PTS, histogram,
+   entropy, signature and border projections), such that the selection can be
+   repeated with other parameters without decoding all candidates again.
+
+   The file is a header followed by fixed-size records and is read through mmap.
+   The size and modification time of the video and the parameters the candidates
+   were computed with are recorded; a store that does not match is not used.
+ */
+
+struct FeatureStoreParams
+{
+  int64_t  rangeBeginPTS; // first and last frame of the range
+  int64_t  rangeLastPTS;
+  uint32_t sampler;       // SamplerType
+  uint64_t randomSeed;
+  int32_t  candidates;    // requested number of candidates (0: automatic)
+  int32_t  decodeBudget;
+  bool     rejectBlank;
+  bool     complete;      // false if the computation was stopped at the deadline
+};
+
+// Default store location for a video: "<video>.features"
+std::string defaultFeatureStorePath(const char* videoFilename);
+
+/* Returns false if the store could not be written, or if the candidates do not all
+   have the same size.
+ */
+bool writeFeatureStore(const char* filename, const char* videoFilename,
+                       const FeatureStoreParams& params,
+                       const std::vector<Candidate>& candidates);
+
+/* Read the candidates (without frame data) from the store.
+   Returns false if there is no valid store for this video, if it was written with
+   other parameters, or if it is incomplete.
+ */
+bool readFeatureStore(const char* filename, const char* videoFilename,
+                      const FeatureStoreParams& params,
+                      std::vector<Candidate>& candidates);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "io.hh"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+FileInput::FileInput()
+{
+  mFd = -1;
+  mMode = IO_Default;
+  mSize = 0;
+  mPos = 0;
+  mBytesRead = 0;
+  mMap = NULL;
+  mAVIO = NULL;
+}
+
+
+FileInput::~FileInput()
+{
+  close();
+}
+
+
+bool FileInput::open(const char* filename, Mode mode)
+{
+  close();
+
+  if (mode == IO_Default) {
+    return false;
+  }
+
+  int fd = ::open(filename, O_RDONLY);
+  if (fd<0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)<0 || !S_ISREG(st.st_mode)) {
+    ::close(fd);
+    return false;
+  }
+
+  mFd = fd;
+  mMode = mode;
+  mSize = st.st_size;
+  mPos = 0;
+  mBytesRead = 0;
+
+  posix_fadvise(mFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  if (mode == IO_MMap && mSize>0) {
+    void* map = mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, mFd, 0);
+    if (map == MAP_FAILED) {
+      mMode = IO_Read; // fall back to reading
+    }
+    else {
+      mMap = (uint8_t*)map;
+      madvise(mMap, mSize, MADV_SEQUENTIAL);
+    }
+  }
+
+  uint8_t* buffer = (uint8_t*)av_malloc(ReadBufferSize);
+  mAVIO = avio_alloc_context(buffer, ReadBufferSize, 0, this,
+                             readPacket, NULL, seek);
+
+  return true;
+}
+
+
+void FileInput::close()
+{
+  if (mAVIO) {
+    av_freep(&mAVIO->buffer);
+    av_freep(&mAVIO);
+  }
+
+  if (mMap) {
+    munmap(mMap, mSize);
+    mMap = NULL;
+  }
+
+  if (mFd>=0) {
+    ::close(mFd);
+    mFd = -1;
+  }
+}
+
+
+void FileInput::willNeed(int64_t offset, int64_t length)
+{
+  if (mFd<0 || offset<0 || length<=0 || offset>=mSize) {
+    return;
+  }
+
+  length = std::min(length, mSize-offset);
+
+  if (mMap) {
+    // madvise() needs a page aligned start
+
+    int64_t pageSize = sysconf(_SC_PAGESIZE);
+    int64_t start = offset & ~(pageSize-1);
+    madvise(mMap+start, length + (offset-start), MADV_WILLNEED);
+  }
+  else {
+    posix_fadvise(mFd, offset, length, POSIX_FADV_WILLNEED);
+  }
+}
+
+
+int FileInput::readPacket(void* opaque, uint8_t* buf, int size)
+{
+  FileInput* in = (FileInput*)opaque;
+
+  if (in->mPos >= in->mSize) {
+    return AVERROR_EOF;
+  }
+
+  if (in->mPos + size > in->mSize) {
+    size = in->mSize - in->mPos;
+  }
+
+  if (in->mMap) {
+    memcpy(buf, in->mMap + in->mPos, size);
+  }
+  else {
+    ssize_t n;
+    do {
+      n = pread(in->mFd, buf, size, in->mPos);
+    } while (n<0 && errno==EINTR);
+
+    if (n<0) {
+      return AVERROR(errno);
+    }
+
+    if (n==0) {
+      return AVERROR_EOF;
+    }
+
+    size = n;
+  }
+
+  in->mPos += size;
+  in->mBytesRead += size;
+
+  return size;
+}
+
+
+int64_t FileInput::seek(void* opaque, int64_t offset, int whence)
+{
+  FileInput* in = (FileInput*)opaque;
+
+  switch (whence & ~AVSEEK_FORCE) {
+  case AVSEEK_SIZE: return in->mSize;
+  case SEEK_SET: in->mPos = offset; break;
+  case SEEK_CUR: in->mPos += offset; break;
+  case SEEK_END: in->mPos = in->mSize + offset; break;
+  default:
+    return -1;
+  }
+
+  return in->mPos;
+}
@@ -0,0 +1,76 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IO_HH
+#define IO_HH
+
+#include <stdint.h>
+
+extern "C" {
+#include "libavformat/avformat.h"
+}
+
+
+/* File input for libavformat through a custom AVIOContext.
+
+   IO_Read: large aligned reads with pread() into the AVIO buffer.
+   IO_MMap: the file is memory mapped, reads are copies out of the mapping.
+
+   Both modes give the kernel sequential read-ahead hints. Only regular files
+   are supported; for anything else, libavformat's own I/O has to be used.
+ */
+class FileInput
+{
+public:
+  enum Mode { IO_Default, IO_Read, IO_MMap };
+
+  FileInput();
+  ~FileInput();
+
+  bool open(const char* filename, Mode mode);
+  void close();
+
+  bool isOpen() const { return mFd >= 0; }
+
+  AVIOContext* getAVIOContext() { return mAVIO; }
+
+  int64_t getBytesRead() const { return mBytesRead; }
+
+  // Hint that the byte range will be read soon (read-ahead into the page cache).
+  void willNeed(int64_t offset, int64_t length);
+
+  static const int ReadBufferSize = 1024*1024;
+
+private:
+  int     mFd;
+  Mode    mMode;
+  int64_t mSize;
+  int64_t mPos;
+  int64_t mBytesRead;
+
+  uint8_t* mMap;
+
+  AVIOContext* mAVIO;
+
+  static int     readPacket(void* opaque, uint8_t* buf, int size);
+  static int64_t seek(void* opaque, int64_t offset, int whence);
+};
+
+#endif
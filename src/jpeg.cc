@@ -0,0 +1,87 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "jpeg.hh"
+#include <stdio.h>
+#include <stdlib.h>
+
+extern "C" {
+#include <jpeglib.h>
+}
+
+using namespace videogfx;
+
+
+bool JPEGEncoder::encode(const Image<Pixel>& image, int quality,
+                         std::vector<uint8_t>& out)
+{
+  int w = image.AskWidth();
+  int h = image.AskHeight();
+
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+
+  unsigned char* buffer = NULL;
+  unsigned long  size = 0;
+  jpeg_mem_dest(&cinfo, &buffer, &size);
+
+  cinfo.image_width  = w;
+  cinfo.image_height = h;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_YCbCr;
+
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+
+  jpeg_start_compress(&cinfo, TRUE);
+
+
+  // libjpeg takes interleaved YCbCr scanlines and subsamples the chroma again
+
+  mScanline.resize(3*w);
+
+  Pixel*const* Y = image.AskFrameY();
+  Pixel*const* U = image.AskFrameU();
+  Pixel*const* V = image.AskFrameV();
+
+  while (cinfo.next_scanline < cinfo.image_height) {
+    int y = cinfo.next_scanline;
+
+    for (int x=0;x<w;x++) {
+      mScanline[3*x  ] = Y[y][x];
+      mScanline[3*x+1] = U[y/2][x/2];
+      mScanline[3*x+2] = V[y/2][x/2];
+    }
+
+    JSAMPROW row = &mScanline[0];
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  out.assign(buffer, buffer+size);
+  free(buffer);
+
+  return true;
+}
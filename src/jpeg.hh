@@ -0,0 +1,42 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JPEG_HH
+#define JPEG_HH
+
+#include <vector>
+#include <stdint.h>
+#include <libvideogfx.hh>
+
+
+/* Encode a YUV 4:2:0 image into an in-memory JPEG file.
+   The scanline buffer is kept between calls.
+ */
+class JPEGEncoder
+{
+public:
+  bool encode(const videogfx::Image<videogfx::Pixel>& image, int quality,
+              std::vector<uint8_t>& out);
+
+private:
+  std::vector<uint8_t> mScanline;
+};
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "json.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+
+std::string jsonString(const std::string& str)
+{
+  std::string out = "\"";
+
+  for (char c : str) {
+    switch (c) {
+    case '"':  out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '\n': out += "\\n";  break;
+    case '\r': out += "\\r";  break;
+    case '\t': out += "\\t";  break;
+    default:
+      if ((unsigned char)c < 0x20) {
+        char buf[8];
+        sprintf(buf, "\\u%04x", c);
+        out += buf;
+      }
+      else {
+        out += c;
+      }
+    }
+  }
+
+  out += "\"";
+  return out;
+}
+
+
+static void skipSpace(const std::string& text, size_t& pos)
+{
+  while (pos<text.size() && isspace((unsigned char)text[pos])) pos++;
+}
+
+
+static bool parseString(const std::string& text, size_t& pos, std::string& value)
+{
+  if (pos>=text.size() || text[pos]!='"') return false;
+  pos++;
+
+  value.clear();
+
+  while (pos<text.size() && text[pos]!='"') {
+    char c = text[pos++];
+
+    if (c=='\\') {
+      if (pos>=text.size()) return false;
+
+      c = text[pos++];
+      switch (c) {
+      case 'n': value += '\n'; break;
+      case 'r': value += '\r'; break;
+      case 't': value += '\t'; break;
+      case 'b': value += '\b'; break;
+      case 'f': value += '\f'; break;
+      case 'u':
+        {
+          if (pos+4>text.size()) return false;
+          unsigned int code = strtoul(text.substr(pos,4).c_str(), NULL, 16);
+          pos += 4;
+
+          // encode as UTF-8 (surrogate pairs are not combined)
+          if (code < 0x80) { value += (char)code; }
+          else if (code < 0x800) {
+            value += (char)(0xC0 | (code>>6));
+            value += (char)(0x80 | (code & 0x3F));
+          }
+          else {
+            value += (char)(0xE0 | (code>>12));
+            value += (char)(0x80 | ((code>>6) & 0x3F));
+            value += (char)(0x80 | (code & 0x3F));
+          }
+        }
+        break;
+      default: value += c; break; // '"', '\\', '/'
+      }
+    }
+    else {
+      value += c;
+    }
+  }
+
+  if (pos>=text.size()) return false;
+  pos++; // closing quote
+
+  return true;
+}
+
+
+bool parseJSONObject(const std::string& text,
+                     std::map<std::string,std::string>& fields,
+                     std::string& error)
+{
+  fields.clear();
+
+  size_t pos=0;
+  skipSpace(text,pos);
+
+  if (pos>=text.size() || text[pos]!='{') {
+    error = "expected '{'";
+    return false;
+  }
+  pos++;
+
+  skipSpace(text,pos);
+  if (pos<text.size() && text[pos]=='}') {
+    return true;
+  }
+
+  for (;;) {
+    skipSpace(text,pos);
+
+    std::string key;
+    if (!parseString(text,pos,key)) {
+      error = "expected string as object key";
+      return false;
+    }
+
+    skipSpace(text,pos);
+    if (pos>=text.size() || text[pos]!=':') {
+      error = "expected ':' after key " + key;
+      return false;
+    }
+    pos++;
+    skipSpace(text,pos);
+
+    std::string value;
+    if (pos<text.size() && text[pos]=='"') {
+      if (!parseString(text,pos,value)) {
+        error = "unterminated string value for key " + key;
+        return false;
+      }
+    }
+    else {
+      size_t start=pos;
+      while (pos<text.size() && text[pos]!=',' && text[pos]!='}' &&
+             !isspace((unsigned char)text[pos])) {
+        if (text[pos]=='{' || text[pos]=='[') {
+          error = "nested values are not supported (key " + key + ")";
+          return false;
+        }
+        pos++;
+      }
+
+      value = text.substr(start, pos-start);
+      if (value.empty()) {
+        error = "missing value for key " + key;
+        return false;
+      }
+    }
+
+    fields[key] = value;
+
+    skipSpace(text,pos);
+    if (pos>=text.size()) {
+      error = "unexpected end of input";
+      return false;
+    }
+
+    if (text[pos]=='}') {
+      return true;
+    }
+    else if (text[pos]==',') {
+      pos++;
+    }
+    else {
+      error = "expected ',' or '}'";
+      return false;
+    }
+  }
+}
@@ -0,0 +1,41 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JSON_HH
+#define JSON_HH
+
+#include <string>
+#include <map>
+
+
+// Quote and escape a string for JSON output.
+std::string jsonString(const std::string& str);
+
+
+/* Parse a flat JSON object (no nested objects or arrays) like
+   {"input": "video.mp4", "number": 8, "random": true}.
+   String values are unescaped, other values are returned as written.
+   Returns false and an error message on syntax errors.
+ */
+bool parseJSONObject(const std::string& text,
+                     std::map<std::string,std::string>& fields,
+                     std::string& error);
+
+#endif
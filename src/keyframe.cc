@@ -0,0 +1,1489 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "keyframe.hh"
+#include "decoder.hh"
+#include "sampling.hh"
+#include "featurestore.hh"
+#include "queue.hh"
+extern "C" {
+#include "libavutil/imgutils.h"
+}
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+using namespace videogfx;
+
+
+KeyframeOptions::KeyframeOptions()
+{
+  number = 8;
+  candidates = 0;
+  decodeBudget = 0;
+  sampler = Sampler_Uniform;
+  selection = Selection_Greedy;
+  randomSeed = 1;
+  noseek = false;
+  memoryLimit = 0;
+  deadline = 0;
+  memoryPolicy = Memory_Drop;
+  decodeThreads = 0;
+  prefetch = 0;
+  pipeline = false;
+  analyzeThreads = 0;
+  encodeThreads = 0;
+  rejectBlank = true;
+  refreshFeatures = false;
+  ioMode = FileInput::IO_Read;
+  seekMode = Decoder::Seek_Auto;
+  decoderBackend = Decoder::Backend_Auto;
+  probeSize = 0;
+  analyzeDuration = 0;
+  signatureIndex = NULL;
+
+  borderCropV = false;
+  borderCropH = false;
+  aspectH = 0;
+  aspectV = 0;
+
+  encodeJPEG = true;
+  jpegQuality = 80;
+
+  verbose = false;
+
+  stats = NULL;
+}
+
+
+static const float maxVBorderPercent = 0.25;
+static const float maxHBorderPercent = 0.15;
+static const int   aspect_mean_threshold = 50;
+
+/* The borders are detected on the row/column projections of the candidates,
+   such that no pixel data is needed (the candidates may come from a feature store).
+ */
+
+static void CropBordersV(std::vector<Candidate>& keyframes)
+{
+  const CropRect& crop = keyframes[0].crop;
+
+  int y0 = crop.top;
+  int h = keyframes[0].height - crop.top - crop.bottom;
+
+  int maxBorderWidth = h * maxVBorderPercent;
+  int borderWidth = 0;
+
+  for (int i=1;i<=maxBorderWidth;i++) {
+    int mean = 0;
+    for (const auto& c : keyframes) {
+      mean += c.rowMeans[y0+i-1] + c.rowMeans[y0+h-i];
+    }
+
+    mean /= 2*keyframes.size();
+
+    if (mean < aspect_mean_threshold)
+      borderWidth = i;
+    else
+      break;
+  }
+
+
+  for (auto& c : keyframes) {
+    c.crop.top    += borderWidth;
+    c.crop.bottom += borderWidth;
+  }
+}
+
+
+static void CropBordersH(std::vector<Candidate>& keyframes)
+{
+  const CropRect& crop = keyframes[0].crop;
+
+  int x0 = crop.left;
+  int w = keyframes[0].width - crop.left - crop.right;
+
+  int maxBorderWidth = w * maxHBorderPercent;
+  int borderWidth = 0;
+
+  for (int i=1;i<=maxBorderWidth;i++) {
+    int mean = 0;
+    for (const auto& c : keyframes) {
+      mean += c.colMeans[x0+i-1] + c.colMeans[x0+w-i];
+    }
+
+    mean /= 2*keyframes.size();
+
+    if (mean < aspect_mean_threshold)
+      borderWidth = i;
+    else
+      break;
+  }
+
+
+  for (auto& c : keyframes) {
+    c.crop.left  += borderWidth;
+    c.crop.right += borderWidth;
+  }
+}
+
+
+bool parseAspect(const char* aspect_str, int& aspect_h, int& aspect_v)
+{
+  std::string aspect = aspect_str;
+  size_t pos = aspect.find(':');
+  if (pos == std::string::npos) {
+    fprintf(stderr,"aspect option has wrong format\n");
+    return false;
+  }
+
+  std::string aspect_h_str = aspect.substr(0,pos);
+  std::string aspect_v_str = aspect.substr(pos+1);
+
+  aspect_h = atoi(aspect_h_str.c_str());
+  aspect_v = atoi(aspect_v_str.c_str());
+
+  if (aspect_h<=0 || aspect_v<=0) {
+    fprintf(stderr,"aspects must be > 0\n");
+    return false;
+  }
+
+  return true;
+}
+
+
+bool parseByteSize(const char* str, int64_t& bytes)
+{
+  char* end;
+  double v = strtod(str, &end);
+
+  switch (*end) {
+  case 'k': case 'K': v *= 1024;                   end++; break;
+  case 'm': case 'M': v *= 1024*1024;              end++; break;
+  case 'g': case 'G': v *= 1024.0*1024*1024;       end++; break;
+  }
+
+  if (end==str || *end!=0 || v<0) {
+    return false;
+  }
+
+  bytes = v;
+  return true;
+}
+
+
+bool parsePosition(const char* str, Decoder::Position& pos)
+{
+  std::string s = str;
+  if (s.empty()) {
+    return false;
+  }
+
+  char* end;
+
+  if (s.back()=='f') {
+    pos.unit = Decoder::Position::Frames;
+    pos.value = strtoll(s.c_str(), &end, 10);
+    return *end=='f' && pos.value >= 0;
+  }
+
+
+  // seconds, optionally as [[hh:]mm:]ss.sss
+
+  pos.unit = Decoder::Position::Seconds;
+  pos.value = 0;
+
+  size_t start=0;
+  for (;;) {
+    size_t colon = s.find(':',start);
+    std::string field = s.substr(start, colon==std::string::npos ? std::string::npos : colon-start);
+
+    double v = strtod(field.c_str(), &end);
+    if (field.empty() || *end!=0 || v<0) {
+      return false;
+    }
+
+    pos.value = pos.value*60 + v;
+
+    if (colon==std::string::npos) break;
+    start = colon+1;
+  }
+
+  return true;
+}
+
+
+// Shrink the crop region further (centered) such that it matches the aspect ratio.
+
+static void AspectCrop(CropRect& crop, int width, int height, int aspect_h, int aspect_v)
+{
+  int w = width  - crop.left - crop.right;
+  int h = height - crop.top  - crop.bottom;
+
+  int crop_width  = w;
+  int crop_height = h;
+
+  // --- try horizontal fit ---
+
+  int hfit_height = w*aspect_v/aspect_h;
+  if (hfit_height <= h) {
+    crop_height = hfit_height;
+  }
+  else {
+    // --- try vertical fit ---
+
+    int vfit_width = h*aspect_h/aspect_v;
+    assert(vfit_width <= w);
+    crop_width = vfit_width;
+  }
+
+  crop.left   += (w - crop_width) / 2;
+  crop.right  += w - crop_width - (w - crop_width) / 2;
+  crop.top    += (h - crop_height) / 2;
+  crop.bottom += h - crop_height - (h - crop_height) / 2;
+}
+
+
+KeyframeExtractor::KeyframeExtractor()
+  : mDecoder(new Decoder)
+{
+  mFallbackScaler = NULL;
+  mUsePreloaded = false;
+  mCandidateBytes = 0;
+  mCandidateMemoryLimit = 0;
+  mPrefetchFrames = 0;
+  mDeadlineTime = 0;
+  mDeadlineReached = false;
+  mNumEvaluated = 0;
+  mLoadTime = 0;
+  mNumLoadAttempts = 0;
+}
+
+
+KeyframeExtractor::~KeyframeExtractor()
+{
+  sws_freeContext(mFallbackScaler);
+}
+
+
+void KeyframeExtractor::placeCandidates(const Decoder& decoder, const KeyframeOptions& options,
+                                        std::vector<Candidate>& candidates)
+{
+  int nCandidates = options.candidates;
+  const int CANDIDATES_REDUNDANCY = 2;
+  if (nCandidates==0) { nCandidates=options.number * CANDIDATES_REDUNDANCY; }
+
+  // with a decode budget, these are the coarse samples that are refined later
+
+  if (options.decodeBudget > 0) {
+    nCandidates = std::min(nCandidates, options.decodeBudget);
+  }
+
+  int64_t firstFrame = decoder.getRangeBegin();
+  int64_t nFrames = decoder.getRangeEnd() - firstFrame;
+
+  std::unique_ptr<Sampler> sampler(createSampler(options.sampler, options.randomSeed,
+                                                 &decoder.getKeyframes()));
+
+  for (int64_t f : sampler->sample(firstFrame, nFrames, nCandidates)) {
+    Candidate c;
+    c.frameNr = f;
+    candidates.push_back(c);
+  }
+}
+
+
+/* Get a reference to the frame 'target'. Without seeking, the frames are decoded
+   sequentially and 'position' holds the number of the last decoded frame
+   (start with -1). Frames before 'position' cannot be reached then.
+ */
+FramePtr KeyframeExtractor::loadFrame(Decoder& decoder, const KeyframeOptions& options,
+                                      int64_t target, int64_t& position)
+{
+  Statistics* stats = options.stats;
+
+  if (options.verbose) { printf("loading candidate frame %ld\n", target); }
+
+  if (mUsePreloaded) {
+    auto it = mPreloaded.find(target);
+    return (it != mPreloaded.end() ? it->second : FramePtr());
+  }
+
+  FramePtr frame;
+
+  if (!options.noseek) {
+    decoder.seekToFrame(target);
+
+    StageTimer timer(stats, Statistics::Stage_Convert);
+    frame = referenceFrame(decoder.getVideoFrame(), &mFallbackScaler);
+  }
+  else {
+    while (position < target) {
+      position++;
+      if (position == target) {
+        StageTimer timer(stats, Statistics::Stage_Convert);
+        frame = referenceFrame(decoder.getVideoFrame(), &mFallbackScaler);
+      }
+      decoder.seekToNextVideoFrame();
+    }
+  }
+
+  return frame;
+}
+
+
+/* Without seeking, all frames that may be needed are decoded in one pass, in
+   parallel over the GOPs if the stream has closed GOPs. loadFrame() then
+   serves the frames from memory until releasePreloadedFrames().
+ */
+void KeyframeExtractor::preloadFrames(Decoder& decoder, const KeyframeOptions& options,
+                                      std::vector<int64_t> frameNrs)
+{
+  releasePreloadedFrames();
+
+  int nThreads = options.decodeThreads;
+  if (nThreads <= 0) {
+    nThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+  }
+
+  if (!options.noseek || nThreads==1 || frameNrs.empty() || !decoder.hasClosedGOPs()) {
+    return;
+  }
+
+  std::sort(frameNrs.begin(), frameNrs.end());
+  frameNrs.erase(std::unique(frameNrs.begin(), frameNrs.end()), frameNrs.end());
+
+  std::vector<AVFrame*> frames;
+  if (!decoder.decodeFramesParallel(frameNrs, nThreads, frames)) {
+    return; // decode sequentially
+  }
+
+  StageTimer timer(options.stats, Statistics::Stage_Convert);
+
+  for (size_t i=0;i<frameNrs.size();i++) {
+    if (frames[i]) {
+      mPreloaded[frameNrs[i]] = referenceFrame(frames[i], &mFallbackScaler);
+      av_frame_free(&frames[i]);
+    }
+  }
+
+  mUsePreloaded = true;
+}
+
+
+void KeyframeExtractor::releasePreloadedFrames()
+{
+  mPreloaded.clear();
+  mUsePreloaded = false;
+}
+
+
+static const int MaxReplacementAttempts = 3;
+
+/* Frame to try instead of a rejected candidate 'original' in attempt 1,2,...
+   Returns -1 if there is none before the next candidate.
+ */
+static int64_t replacementFrame(int64_t original, int64_t next, int attempt)
+{
+  int64_t replacement = original + attempt*(next-original)/(MaxReplacementAttempts+1);
+
+  if (attempt > MaxReplacementAttempts ||
+      replacement <= original + (attempt-1)*(next-original)/(MaxReplacementAttempts+1) ||
+      replacement >= next) {
+    return -1;
+  }
+
+  return replacement;
+}
+
+
+void KeyframeExtractor::loadCandidates(Decoder& decoder, const KeyframeOptions& options,
+                                       std::vector<Candidate>& candidates)
+{
+  Statistics* stats = options.stats;
+
+  std::sort(candidates.begin(),
+            candidates.end(),
+            [](const Candidate& a, const Candidate& b) { return a.frameNr < b.frameNr; });
+
+  if (options.pipeline && !options.noseek && mDeadlineTime==0) {
+    loadCandidatesPipelined(decoder, options, candidates);
+    return;
+  }
+
+  bool mayReject = (options.rejectBlank || options.signatureIndex);
+
+  // Preloading keeps all frames in memory at once, thus not with a memory limit.
+  // It decodes all candidates before the first deadline check, thus not with a deadline.
+
+  if (options.noseek && options.memoryLimit==0 && mDeadlineTime==0) {
+    std::vector<int64_t> frameNrs;
+    for (size_t i=0;i<candidates.size();i++) {
+      if (candidates[i].loaded) continue;
+
+      frameNrs.push_back(candidates[i].frameNr);
+
+      if (mayReject) {
+        int64_t next = (i+1<candidates.size() ? candidates[i+1].frameNr : decoder.getRangeEnd());
+        for (int attempt=1; ; attempt++) {
+          int64_t f = replacementFrame(candidates[i].frameNr, next, attempt);
+          if (f<0) break;
+          frameNrs.push_back(f);
+        }
+      }
+    }
+
+    preloadFrames(decoder, options, frameNrs);
+  }
+
+  // When seeking, the candidates can be decoded ahead while the current one is analyzed.
+  // Replacements of rejected frames are not known in advance and are decoded here.
+
+  if (!options.noseek && mPrefetchFrames > 0) {
+    std::vector<int64_t> frameNrs;
+    for (const Candidate& c : candidates) {
+      if (!c.loaded) frameNrs.push_back(c.frameNr);
+    }
+
+    decoder.prefetchFrames(frameNrs, mPrefetchFrames);
+  }
+
+  int64_t position = -1;
+  FramePtr frame;
+
+  double lastStart = 0;
+
+  for (size_t i=0;i<candidates.size();i++) {
+    Candidate& c = candidates[i];
+
+    if (c.loaded) {
+      continue; // from an earlier pass
+    }
+
+    // measure the time per candidate for the deadline estimate
+
+    double now = wallClockSeconds();
+    if (lastStart > 0) {
+      mLoadTime += now - lastStart;
+      mNumLoadAttempts++;
+    }
+    lastStart = now;
+
+    if (checkDeadline(options)) {
+      break; // the remaining candidates are removed below
+    }
+
+    frame = loadFrame(decoder, options, c.frameNr, position);
+
+
+    // Reject blank frames and known boilerplate (intros, logos, ads) early and try a
+    // replacement further on, before the next candidate.
+    // (Only forward, to keep the access pattern sequential.)
+
+    uint64_t dhash = 0;
+
+    auto isRejected = [&]() {
+      if (!frame) {
+        return true; // not reachable without seeking
+      }
+
+      if (options.rejectBlank && isBlankFrame(frame.get())) {
+        return true;
+      }
+
+      dhash = calcDHash(frame.get());
+
+      if (options.signatureIndex) {
+        mSignatures.push_back(dhash);
+        return options.signatureIndex->isBoilerplate(dhash);
+      }
+
+      return false;
+    };
+
+    int64_t next = (i+1<candidates.size() ? candidates[i+1].frameNr : decoder.getRangeEnd());
+    int64_t original = c.frameNr;
+
+    for (int attempt=1; isRejected(); attempt++) {
+      if (stats) stats->count(Statistics::Counter_FramesRejected);
+
+      int64_t replacement = replacementFrame(original, next, attempt);
+      if (replacement < 0) {
+        frame.reset();
+        break;
+      }
+
+      c.frameNr = replacement;
+      frame = loadFrame(decoder, options, c.frameNr, position);
+    }
+
+    if (!frame) {
+      continue; // no usable frame in this interval
+    }
+
+    c.dhash = dhash;
+    c.pts = decoder.getFramePTS(c.frameNr);
+    c.timestamp = decoder.PTS2Time(c.pts);
+
+    c.frame = frame;
+    c.width  = frame->width;
+    c.height = frame->height;
+
+    StageTimer timer(stats, Statistics::Stage_Histogram);
+    c.histogram = calcHistogram(frame.get());
+    c.entropy = calcEntropy(c.histogram);
+
+    if (!options.featureStore.empty()) {
+      calcProjections(frame.get(), c.rowMeans, c.colMeans);
+    }
+
+    timer.stop();
+
+    c.loaded = true;
+    mNumEvaluated++;
+    if (stats) stats->count(Statistics::Counter_FramesUsed);
+
+    frame.reset();
+
+    if (options.memoryLimit > 0) {
+      mCandidateBytes += frameBytes(c.frame.get());
+      limitCandidateMemory(options, candidates);
+    }
+  }
+
+
+  decoder.stopPrefetch();
+  releasePreloadedFrames();
+
+
+  // remove candidates for which no usable frame was found
+
+  candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                  [](const Candidate& c) { return !c.loaded; }),
+                   candidates.end());
+}
+
+
+static int threadCount(int nThreads)
+{
+  return (nThreads > 0 ? nThreads : std::max((int)std::thread::hardware_concurrency(), 1));
+}
+
+
+namespace {
+
+  struct DecodedFrame
+  {
+    size_t   index;  // in the list of requested frames
+    AVFrame* frame;  // NULL if it could not be decoded
+  };
+
+  struct AnalyzedFrame
+  {
+    size_t   index;
+    FramePtr frame;
+    bool     blank;
+
+    uint64_t dhash;
+    cvalgo::Histogram histogram;
+    double   entropy;
+    std::vector<uint8_t> rowMeans, colMeans;
+  };
+
+
+  // Feature computation stage of the pipeline. Each worker has its own scaler.
+
+  struct AnalysisWorker
+  {
+    const KeyframeOptions* options;
+    struct SwsContext* scaler;
+
+    double busy;
+    double convertWall, convertCPU;
+    double featureWall, featureCPU;
+
+    void run(BoundedQueue<DecodedFrame>* in, BoundedQueue<AnalyzedFrame*>* out)
+    {
+      DecodedFrame d;
+      while (in->pop(d)) {
+        double wallStart = wallClockSeconds();
+        double cpuStart  = threadCPUSeconds();
+
+        AnalyzedFrame* r = new AnalyzedFrame;
+        r->index = d.index;
+        r->blank = false;
+        r->dhash = 0;
+        r->entropy = 0;
+
+        if (d.frame) {
+          r->frame = referenceFrame(d.frame, &scaler);
+          av_frame_free(&d.frame);
+        }
+
+        double wallMid = wallClockSeconds();
+        double cpuMid  = threadCPUSeconds();
+        convertWall += wallMid - wallStart;
+        convertCPU  += cpuMid  - cpuStart;
+
+        if (r->frame) {
+          const AVFrame* f = r->frame.get();
+
+          r->blank = (options->rejectBlank && isBlankFrame(f));
+
+          if (!r->blank) {
+            r->dhash = calcDHash(f);
+            r->histogram = calcHistogram(f);
+            r->entropy = calcEntropy(r->histogram);
+
+            if (!options->featureStore.empty()) {
+              calcProjections(f, r->rowMeans, r->colMeans);
+            }
+          }
+        }
+
+        featureWall += wallClockSeconds() - wallMid;
+        featureCPU  += threadCPUSeconds() - cpuMid;
+        busy += wallClockSeconds() - wallStart;
+
+        out->push(r);
+      }
+    }
+  };
+}
+
+
+/* Pipelined variant of loadCandidates() for seekable input: one thread demuxes
+   (Decoder::decodeFrames()), a pool decodes the GOPs, another pool computes the
+   features, and this thread applies the rejection rules and keeps the results.
+   The stages are connected by bounded queues, which also bound the number of
+   frames in flight. Rejected candidates are retried with their replacement
+   frames in a further pass.
+ */
+void KeyframeExtractor::loadCandidatesPipelined(Decoder& decoder, const KeyframeOptions& options,
+                                                std::vector<Candidate>& candidates)
+{
+  Statistics* stats = options.stats;
+
+  int nDecodeThreads  = threadCount(options.decodeThreads);
+  int nAnalyzeThreads = threadCount(options.analyzeThreads);
+
+  struct Target
+  {
+    size_t  candidate;
+    int64_t original, next; // replacements are searched in between
+    int     attempt;
+  };
+
+  std::vector<Target> targets;
+  for (size_t i=0;i<candidates.size();i++) {
+    if (!candidates[i].loaded) {
+      Target t;
+      t.candidate = i;
+      t.original = candidates[i].frameNr;
+      t.next = (i+1<candidates.size() ? candidates[i+1].frameNr : decoder.getRangeEnd());
+      t.attempt = 0;
+      targets.push_back(t);
+    }
+  }
+
+  int64_t nRejected=0, nUsed=0;
+
+  while (!targets.empty()) {
+    std::vector<int64_t> frameNrs;
+    for (const Target& t : targets) {
+      frameNrs.push_back(candidates[t.candidate].frameNr);
+    }
+
+    BoundedQueue<DecodedFrame>   decoded (4*nAnalyzeThreads);
+    BoundedQueue<AnalyzedFrame*> analyzed(4*nAnalyzeThreads);
+
+    double startTime = wallClockSeconds();
+
+
+    // --- start the stages ---
+
+    std::vector<AnalysisWorker> workers(nAnalyzeThreads);
+    std::vector<std::thread> threads;
+
+    for (auto& w : workers) {
+      w.options = &options;
+      w.scaler = NULL;
+      w.busy = w.convertWall = w.convertCPU = w.featureWall = w.featureCPU = 0;
+      threads.push_back(std::thread(&AnalysisWorker::run, &w, &decoded, &analyzed));
+    }
+
+    std::thread demuxThread([&]() {
+        bool ok = decoder.decodeFrames(frameNrs, nDecodeThreads, [&](size_t i, AVFrame* frame) {
+            DecodedFrame d;
+            d.index = i;
+            d.frame = frame;
+            decoded.push(d);
+          });
+
+        if (!ok) {
+          for (size_t i=0;i<frameNrs.size();i++) {
+            DecodedFrame d;
+            d.index = i;
+            d.frame = NULL;
+            decoded.push(d);
+          }
+        }
+
+        decoded.close();
+      });
+
+
+    // --- collect the results (exactly one per requested frame) ---
+
+    std::vector<Target> retry;
+
+    for (size_t n=0;n<frameNrs.size();n++) {
+      AnalyzedFrame* r;
+      analyzed.pop(r);
+
+      const Target& t = targets[r->index];
+      Candidate& c = candidates[t.candidate];
+
+      bool rejected = (!r->frame || r->blank);
+
+      if (!rejected && options.signatureIndex) {
+        mSignatures.push_back(r->dhash);
+        rejected = options.signatureIndex->isBoilerplate(r->dhash);
+      }
+
+      if (rejected) {
+        nRejected++;
+
+        int64_t replacement = replacementFrame(t.original, t.next, t.attempt+1);
+        if (replacement >= 0) {
+          Target u = t;
+          u.attempt++;
+          c.frameNr = replacement;
+          retry.push_back(u);
+        }
+      }
+      else {
+        c.dhash = r->dhash;
+        c.pts = decoder.getFramePTS(c.frameNr);
+        c.timestamp = decoder.PTS2Time(c.pts);
+
+        c.frame = r->frame;
+        c.width  = c.frame->width;
+        c.height = c.frame->height;
+
+        c.histogram = r->histogram;
+        c.entropy = r->entropy;
+        c.rowMeans.swap(r->rowMeans);
+        c.colMeans.swap(r->colMeans);
+
+        c.loaded = true;
+        mNumEvaluated++;
+        nUsed++;
+
+        if (options.memoryLimit > 0) {
+          mCandidateBytes += frameBytes(c.frame.get());
+          limitCandidateMemory(options, candidates);
+        }
+      }
+
+      delete r;
+    }
+
+    demuxThread.join();
+    for (auto& t : threads) {
+      t.join();
+    }
+
+    double elapsed = wallClockSeconds() - startTime;
+    double analyzeBusy = 0;
+
+    for (auto& w : workers) {
+      if (stats) {
+        stats->addTime(Statistics::Stage_Convert,   w.convertWall, w.convertCPU);
+        stats->addTime(Statistics::Stage_Histogram, w.featureWall, w.featureCPU);
+      }
+
+      analyzeBusy += w.busy;
+      sws_freeContext(w.scaler);
+    }
+
+    if (stats) {
+      stats->addPipelineLoad(Statistics::Pipeline_Analyze, nAnalyzeThreads, analyzeBusy, elapsed);
+    }
+
+
+    // the replacement frames of the rejected candidates, in frame order
+
+    std::sort(retry.begin(), retry.end(),
+              [](const Target& a, const Target& b) { return a.candidate < b.candidate; });
+
+    targets.swap(retry);
+  }
+
+  if (stats) {
+    stats->count(Statistics::Counter_FramesRejected, nRejected);
+    stats->count(Statistics::Counter_FramesUsed, nUsed);
+  }
+
+
+  // remove candidates for which no usable frame was found
+
+  candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                  [](const Candidate& c) { return !c.loaded; }),
+                   candidates.end());
+}
+
+
+/* Release the pixels of the candidates with the lowest entropy until the
+   frames held fit into the memory limit. The features are kept. The pixels are
+   either dropped (and decoded again if the candidate is selected) or written
+   to the spill file.
+ */
+void KeyframeExtractor::limitCandidateMemory(const KeyframeOptions& options,
+                                             std::vector<Candidate>& candidates)
+{
+  while (mCandidateBytes > mCandidateMemoryLimit) {
+    Candidate* lowest = NULL;
+    for (auto& c : candidates) {
+      if (c.frame && (lowest==NULL || c.entropy < lowest->entropy)) {
+        lowest = &c;
+      }
+    }
+
+    if (lowest==NULL) {
+      break;
+    }
+
+    if (options.memoryPolicy == KeyframeOptions::Memory_Spill) {
+      lowest->spillOffset = mSpill.store(lowest->frame.get());
+    }
+
+    if (options.stats) options.stats->count(Statistics::Counter_FramesEvicted);
+
+    mCandidateBytes -= frameBytes(lowest->frame.get());
+    lowest->frame.reset();
+  }
+}
+
+
+/* Decode the frames of candidates that only have their features (from a feature
+   store, or dropped because of the memory limit) and compute missing projections
+   if border cropping needs them.
+ */
+void KeyframeExtractor::fetchFrames(Decoder& decoder, const KeyframeOptions& options,
+                                    std::vector<Candidate>& candidates)
+{
+  std::vector<Candidate*> missing;
+  for (auto& c : candidates) {
+    if (!c.frame && c.spillOffset>=0) {
+      c.frame = mSpill.load(c.spillOffset);
+    }
+
+    if (!c.frame) missing.push_back(&c);
+  }
+
+  std::sort(missing.begin(), missing.end(),
+            [](const Candidate* a, const Candidate* b) { return a->frameNr < b->frameNr; });
+
+  // without seeking, we have to start again from the beginning
+
+  if (options.noseek && !missing.empty() && decoder.getCurrentFrameNr() > 0) {
+    decoder.loadMovie(decoder.getInputFileName().c_str());
+  }
+
+  if (options.noseek && options.memoryLimit==0) {
+    std::vector<int64_t> frameNrs;
+    for (Candidate* c : missing) frameNrs.push_back(c->frameNr);
+    preloadFrames(decoder, options, frameNrs);
+  }
+
+  if (!options.noseek && mPrefetchFrames > 0) {
+    std::vector<int64_t> frameNrs;
+    for (Candidate* c : missing) frameNrs.push_back(c->frameNr);
+    decoder.prefetchFrames(frameNrs, mPrefetchFrames);
+  }
+
+  int64_t position = -1;
+  for (Candidate* c : missing) {
+    c->frame = loadFrame(decoder, options, c->frameNr, position);
+  }
+
+  decoder.stopPrefetch();
+  releasePreloadedFrames();
+
+  // frames that could not be decoded are dropped
+
+  candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                  [](const Candidate& c) { return !c.frame; }),
+                   candidates.end());
+
+  if (options.borderCropV || options.borderCropH) {
+    for (auto& c : candidates) {
+      if (c.rowMeans.empty()) {
+        calcProjections(c.frame.get(), c.rowMeans, c.colMeans);
+      }
+    }
+  }
+}
+
+
+/* True if there is no time left to load another candidate and still finish
+   (fetch and encode the keyframes, estimated as 'number' candidate loads)
+   before the deadline. There is always time for the first candidate.
+ */
+bool KeyframeExtractor::checkDeadline(const KeyframeOptions& options)
+{
+  if (mDeadlineTime==0 || mNumEvaluated==0) {
+    return false;
+  }
+
+  double avg = (mNumLoadAttempts ? mLoadTime / mNumLoadAttempts : 0);
+
+  if (wallClockSeconds() + avg*(1+options.number) > mDeadlineTime) {
+    mDeadlineReached = true;
+  }
+
+  return mDeadlineReached;
+}
+
+
+void KeyframeExtractor::computeCandidates(Decoder& decoder, const KeyframeOptions& options,
+                                          std::vector<Candidate>& candidates)
+{
+  // --- initial set of candidates ---
+
+  placeCandidates(decoder, options, candidates);
+
+  mSignatures.clear();
+  mSpill.clear();
+  mCandidateBytes = 0;
+
+
+  // The memory limit covers the candidate frames, the decoder's frame cache and the
+  // prefetch buffer. The cache and the prefetch buffer get up to a quarter of it each.
+
+  if (options.memoryLimit > 0) {
+    const AVCodecContext* ctx = decoder.getVideoStream()->codec;
+    int64_t bytesPerFrame = std::max((int64_t)av_image_get_buffer_size(ctx->pix_fmt, ctx->width, ctx->height, 1),
+                                     (int64_t)1);
+
+    int nCacheFrames = std::min((int64_t)Decoder::DefaultFrameCacheSize, options.memoryLimit/4/bytesPerFrame);
+    decoder.setFrameCacheSize(nCacheFrames);
+
+    // besides the buffer, one frame is held by the prefetch thread and one by the decoder
+
+    int64_t nPrefetchFrames = 0;
+    if (mPrefetchFrames > 0) {
+      mPrefetchFrames = std::max((int64_t)0, std::min((int64_t)mPrefetchFrames,
+                                                      options.memoryLimit/4/bytesPerFrame - 2));
+      if (mPrefetchFrames > 0) nPrefetchFrames = mPrefetchFrames + 2;
+    }
+
+    mCandidateMemoryLimit = options.memoryLimit - (nCacheFrames+nPrefetchFrames)*bytesPerFrame;
+  }
+  else {
+    decoder.setFrameCacheSize(Decoder::DefaultFrameCacheSize);
+  }
+
+
+  // --- load video frames ---
+
+  if (mDeadlineTime > 0 && !options.noseek) {
+
+    // Anytime mode: load coarse-to-fine (bisecting the timeline), such that the
+    // candidates loaded when the deadline is reached cover the whole video.
+
+    std::vector<int64_t> frames;
+    for (const auto& c : candidates) frames.push_back(c.frameNr);
+    std::sort(frames.begin(), frames.end());
+
+    candidates.clear();
+
+    for (const auto& level : bisectionLevels(frames)) {
+      for (int64_t f : level) {
+        Candidate c;
+        c.frameNr = f;
+        candidates.push_back(c);
+      }
+
+      loadCandidates(decoder, options, candidates);
+
+      if (mDeadlineReached) {
+        break;
+      }
+    }
+  }
+  else {
+    loadCandidates(decoder, options, candidates);
+  }
+
+
+  // --- adaptive refinement: spend the remaining decode budget where the content changes ---
+
+  if (options.decodeBudget > 0 && !options.noseek) {
+    int nDecoded = candidates.size();
+
+    while (nDecoded < options.decodeBudget && !mDeadlineReached) {
+      std::vector<int64_t> frames = refinementFrames(candidates, options.decodeBudget - nDecoded);
+      if (frames.empty()) {
+        break;
+      }
+
+      for (int64_t f : frames) {
+        Candidate c;
+        c.frameNr = f;
+        candidates.push_back(c);
+      }
+
+      // only the new candidates are loaded (sorted in between the existing ones)
+
+      loadCandidates(decoder, options, candidates);
+      nDecoded += frames.size(); // also count rejected frames, to guarantee progress
+    }
+  }
+
+
+  if (options.signatureIndex) {
+    options.signatureIndex->addVideo(mSignatures,
+                                     SignatureIndex::videoKey(decoder.getInputFileName().c_str()));
+  }
+}
+
+
+static Keyframe makeKeyframe(const Candidate& c, int64_t indexBase)
+{
+  Keyframe k;
+  k.frameNr = indexBase + c.frameNr;
+  k.pts = c.pts;
+  k.timestamp = c.timestamp;
+  k.entropy = c.entropy;
+  k.min_histogram_distance = c.min_histogram_distance;
+  k.score = c.score;
+  k.dhash = c.dhash;
+  k.frame = c.frame;
+  k.crop = c.crop;
+
+  return k;
+}
+
+
+/* Aspect crop, encode and append the keyframe. Its frame is decoded first if
+   it is not available.
+ */
+void KeyframeExtractor::finishKeyframe(Decoder& decoder, const KeyframeOptions& options,
+                                       Candidate& c, std::vector<Keyframe>& keyframes)
+{
+  Statistics* stats = options.stats;
+
+  if (!c.frame) {
+    std::vector<Candidate> missing(1, c);
+    fetchFrames(decoder, options, missing);
+
+    if (missing.empty()) {
+      return;
+    }
+
+    c = missing[0];
+  }
+
+  if (options.aspectH > 0 && options.aspectV > 0) {
+    StageTimer timer(stats, Statistics::Stage_Crop);
+    AspectCrop(c.crop, c.width, c.height, options.aspectH, options.aspectV);
+  }
+
+  Keyframe k = makeKeyframe(c, decoder.getIndexBase());
+
+  if (options.encodeJPEG) {
+    StageTimer timer(stats, Statistics::Stage_Encode);
+    mJPEGEncoder.encode(convertToImage(c.frame.get(), c.crop), options.jpegQuality, k.jpeg);
+  }
+
+  keyframes.push_back(k);
+
+  if (options.onKeyframe) {
+    options.onKeyframe(keyframes.back(), keyframes.size());
+  }
+}
+
+
+/* Encode stage of the pipeline: aspect crop and append all (fetched) candidates
+   as keyframes, encoding the JPEGs on several threads, each with its own encoder.
+   The keyframes are appended and reported in rank order.
+ */
+void KeyframeExtractor::encodeKeyframes(const KeyframeOptions& options,
+                                        std::vector<Candidate>& ranked,
+                                        std::vector<Keyframe>& keyframes)
+{
+  Statistics* stats = options.stats;
+
+  std::vector<Keyframe> encoded;
+
+  for (auto& c : ranked) {
+    if (options.aspectH > 0 && options.aspectV > 0) {
+      AspectCrop(c.crop, c.width, c.height, options.aspectH, options.aspectV);
+    }
+
+    encoded.push_back(makeKeyframe(c, mDecoder->getIndexBase()));
+  }
+
+  if (options.encodeJPEG && !encoded.empty()) {
+    int nThreads = std::min(threadCount(options.encodeThreads), (int)encoded.size());
+
+    struct EncodeWorker
+    {
+      JPEGEncoder encoder;
+      double wallTime, cpuTime;
+    };
+
+    std::vector<EncodeWorker> workers(nThreads);
+    std::atomic<size_t> nextIndex(0);
+
+    auto encode = [&](EncodeWorker* w) {
+      double wallStart = wallClockSeconds();
+      double cpuStart  = threadCPUSeconds();
+
+      for (size_t i; (i = nextIndex++) < encoded.size(); ) {
+        Keyframe& k = encoded[i];
+        w->encoder.encode(convertToImage(k.frame.get(), k.crop), options.jpegQuality, k.jpeg);
+      }
+
+      w->wallTime = wallClockSeconds() - wallStart;
+      w->cpuTime  = threadCPUSeconds() - cpuStart;
+    };
+
+    double startTime = wallClockSeconds();
+
+    std::vector<std::thread> threads;
+    for (int t=1;t<nThreads;t++) {
+      threads.push_back(std::thread(encode, &workers[t]));
+    }
+    encode(&workers[0]);
+
+    for (auto& t : threads) {
+      t.join();
+    }
+
+    double elapsed = wallClockSeconds() - startTime;
+    double busy = 0;
+
+    for (auto& w : workers) {
+      if (stats) stats->addTime(Statistics::Stage_Encode, w.wallTime, w.cpuTime);
+      busy += w.wallTime;
+    }
+
+    if (stats) {
+      stats->addPipelineLoad(Statistics::Pipeline_Encode, nThreads, busy, elapsed);
+    }
+  }
+
+  for (auto& k : encoded) {
+    keyframes.push_back(k);
+
+    if (options.onKeyframe) {
+      options.onKeyframe(keyframes.back(), keyframes.size());
+    }
+  }
+}
+
+
+int KeyframeExtractor::extract(const char* filename, const KeyframeOptions& options,
+                               std::vector<Keyframe>& keyframes)
+{
+  Statistics* stats = options.stats;
+
+  keyframes.clear();
+
+  mDeadlineTime = (options.deadline > 0 ? wallClockSeconds() + options.deadline : 0);
+  mDeadlineReached = false;
+  mNumEvaluated = 0;
+  mLoadTime = 0;
+  mNumLoadAttempts = 0;
+  mPrefetchFrames = options.prefetch;
+
+
+  // --- init video decoder ---
+
+  // the decoder object is reused between videos
+
+  Decoder& decoder = *mDecoder;
+  decoder.setStatistics(stats);
+  decoder.setIOMode(options.ioMode);
+  decoder.setSeekMode(options.seekMode);
+  decoder.setRange(options.rangeStart, options.rangeEnd);
+  decoder.setProbeLimits(options.probeSize, int64_t(options.analyzeDuration * AV_TIME_BASE));
+  decoder.setIndexCache(options.indexCache);
+
+  decoder.setBackend(options.decoderBackend, options.decodeThreads);
+
+  int err = decoder.loadMovie(filename);
+  if (err) {
+    return err;
+  }
+
+  if (options.verbose) {
+    printf("decoding with %s\n", decoder.getBackendName());
+  }
+
+  if (decoder.getRangeEnd() <= decoder.getRangeBegin()) {
+    decoder.close();
+    return 1; // no frames within range
+  }
+
+
+  // --- candidates: from the feature store, or decode and compute ---
+
+  std::vector<Candidate> candidates;
+  bool fromStore = false;
+
+  FeatureStoreParams storeParams;
+  storeParams.rangeBeginPTS = decoder.getFramePTS(decoder.getRangeBegin());
+  storeParams.rangeLastPTS  = decoder.getFramePTS(decoder.getRangeEnd()-1);
+  storeParams.sampler       = options.sampler;
+  storeParams.randomSeed    = options.randomSeed;
+  storeParams.candidates    = options.candidates;
+  storeParams.decodeBudget  = options.decodeBudget;
+  storeParams.rejectBlank   = options.rejectBlank;
+  storeParams.complete      = true;
+
+  if (!options.featureStore.empty() && !options.refreshFeatures) {
+    fromStore = readFeatureStore(options.featureStore.c_str(), filename, storeParams, candidates);
+
+    // Frame numbers are indices into the decoder's frame index. The frames are
+    // found again by their PTS, dropping any that are not in the index anymore.
+
+    int64_t begin = decoder.getRangeBegin();
+    int64_t end   = decoder.getRangeEnd();
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                    [&decoder,begin,end](Candidate& c) {
+                                      c.frameNr = decoder.findFrameNrWithPTS(c.pts);
+                                      return c.frameNr < begin || c.frameNr >= end; }),
+                     candidates.end());
+
+    if (candidates.empty()) {
+      fromStore = false;
+    }
+
+    if (fromStore) {
+      mNumEvaluated = candidates.size();
+    }
+
+    if (options.verbose && fromStore) {
+      printf("using %d candidates from feature store %s\n", (int)candidates.size(),
+             options.featureStore.c_str());
+    }
+  }
+
+  if (!fromStore) {
+    candidates.clear();
+    computeCandidates(decoder, options, candidates);
+
+    // with a deadline, not all candidates may have been evaluated
+
+    storeParams.complete = !mDeadlineReached;
+
+    if (!options.featureStore.empty() &&
+        !writeFeatureStore(options.featureStore.c_str(), filename, storeParams, candidates)) {
+      fprintf(stderr, "cannot write feature store %s\n", options.featureStore.c_str());
+    }
+  }
+
+
+  // --- rank candidates ---
+
+  // Without border cropping (which needs all keyframes), each keyframe is
+  // finished and emitted as soon as the greedy selection picks it.
+  // Without seeking, each keyframe without pixels would need a pass over the video,
+  // thus the missing frames are then fetched together after the selection.
+
+  bool progressive = options.onKeyframe && !options.borderCropV && !options.borderCropH;
+
+  if (progressive && options.noseek) {
+    for (const auto& c : candidates) {
+      if (!c.frame && c.spillOffset<0) {
+        progressive = false;
+        break;
+      }
+    }
+  }
+
+  std::vector<Candidate> ranked;
+
+  {
+    StageTimer timer(stats, Statistics::Stage_Selection);
+
+    SelectionCallback onSelected;
+    if (progressive) {
+      onSelected = [&](Candidate& c) {
+        if (ranked.size() <= options.number) {
+          finishKeyframe(decoder, options, c, keyframes);
+        }
+      };
+    }
+
+    if (options.selection == KeyframeOptions::Selection_Cluster) {
+      clusterKeyframes(candidates, ranked, options.number, 0, options.randomSeed, onSelected);
+    }
+    else {
+      selectKeyframes(candidates, ranked, onSelected);
+    }
+  }
+
+  if (options.verbose) {
+    int64_t indexBase = decoder.getIndexBase();
+    int cnt=1;
+    for (const auto& c : ranked) {
+      bool save = (cnt <= options.number);
+      printf("%2d%c: #=%5ld E=%f hd=%f\n",cnt, save ? '*':' ', indexBase + c.frameNr,
+             c.entropy, c.min_histogram_distance);
+      cnt++;
+    }
+  }
+
+  if (ranked.size() > options.number) {
+    ranked.resize(options.number);
+  }
+
+
+  if (!progressive) {
+
+    // --- decode the selected frames that were taken from the feature store ---
+
+    fetchFrames(decoder, options, ranked);
+
+
+    // --- crop borders ---
+
+    StageTimer cropTimer(stats, Statistics::Stage_Crop);
+
+    if (!ranked.empty() && options.borderCropV) {
+      CropBordersV(ranked);
+    }
+
+    if (!ranked.empty() && options.borderCropH) {
+      CropBordersH(ranked);
+    }
+
+    cropTimer.stop();
+
+
+    // --- output ---
+
+    if (options.pipeline) {
+      encodeKeyframes(options, ranked, keyframes);
+    }
+    else {
+      for (auto& c : ranked) {
+        finishKeyframe(decoder, options, c, keyframes);
+      }
+    }
+  }
+
+  if (stats) {
+    stats->setBytesRead(decoder.getBytesRead());
+  }
+
+  decoder.close();
+
+  return 0;
+}
+
+
+bool isValidOutputPattern(const char* pattern)
+{
+  int nConversions = 0;
+
+  for (const char* p=pattern; *p; p++) {
+    if (*p != '%') {
+      continue;
+    }
+
+    p++;
+    if (*p == '%') {
+      continue;
+    }
+
+    while (*p && strchr("-+ #0", *p)) p++;
+    while (isdigit(*p)) p++;
+    if (*p == '.') {
+      p++;
+      while (isdigit(*p)) p++;
+    }
+
+    if (*p==0 || !strchr("diouxX", *p)) {
+      return false;
+    }
+
+    nConversions++;
+  }
+
+  return nConversions==1;
+}
+
+
+bool writeKeyframeFile(const Keyframe& keyframe, const char* pattern, int nr,
+                       std::string* filename)
+{
+  if (!isValidOutputPattern(pattern)) {
+    fprintf(stderr, "invalid output pattern (needs one integer conversion like %%02d): %s\n", pattern);
+    return false;
+  }
+
+  char name[1000];
+  snprintf(name, sizeof(name), pattern, nr);
+
+  FILE* fh = fopen(name, "wb");
+  if (fh==NULL) {
+    fprintf(stderr, "cannot write %s\n", name);
+    return false;
+  }
+
+  fwrite(keyframe.jpeg.data(), 1, keyframe.jpeg.size(), fh);
+  fclose(fh);
+
+  if (filename) {
+    *filename = name;
+  }
+
+  return true;
+}
+
+
+bool writeKeyframeFiles(const std::vector<Keyframe>& keyframes, const char* pattern,
+                        std::vector<std::string>* filenames)
+{
+  int cnt=1;
+  for (const auto& k : keyframes) {
+    std::string name;
+    if (!writeKeyframeFile(k, pattern, cnt, &name)) {
+      return false;
+    }
+
+    if (filenames) {
+      filenames->push_back(name);
+    }
+
+    cnt++;
+  }
+
+  return true;
+}
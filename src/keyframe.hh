@@ -0,0 +1,229 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KEYFRAME_HH
+#define KEYFRAME_HH
+
+/* libkeyframe: in-process keyframe extraction.
+
+   All state lives in the KeyframeExtractor object. Separate objects can be
+   used concurrently from different threads. One object can process any
+   number of videos sequentially, reusing its scratch buffers.
+ */
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <map>
+#include <stdint.h>
+
+#include "features.hh"
+#include "selection.hh"
+#include "sampling.hh"
+#include "stats.hh"
+#include "jpeg.hh"
+#include "io.hh"
+#include "decoder.hh"
+#include "signatures.hh"
+#include "spill.hh"
+
+
+struct Keyframe;
+
+struct KeyframeOptions
+{
+  KeyframeOptions();
+
+  int  number;        // number of keyframes to generate
+  int  candidates;    // number of candidates to consider (0: automatic)
+  int  decodeBudget;  // if >0: adaptively add candidates where the content changes,
+                      //        until this number of frames has been decoded
+  SamplerType sampler; // candidate placement
+  uint64_t randomSeed;  // for the random samplers
+  bool noseek;        // do not seek within video (for broken video streams)
+  int  decodeThreads; // threads for GOP-parallel decoding with 'noseek' or 'pipeline',
+                      // and for the libde265 backend (0: all cores)
+  int  prefetch;      // if >0: candidate frames decoded ahead on a background thread (when seeking)
+
+  bool pipeline;       // demux, decode, analyze and encode concurrently, on separate threads
+  int  analyzeThreads; // threads for the feature computation in the pipeline (0: all cores)
+  int  encodeThreads;  // threads for JPEG encoding in the pipeline (0: all cores)
+
+  double deadline;     // if >0: seconds after which the best keyframes so far are output
+                       //        (candidates are then processed coarse-to-fine)
+
+  int64_t memoryLimit; // bytes for decoded frames (0: unlimited): the candidates, the decoder's
+                       // frame cache and the prefetch buffer. Not counted are the codec's own
+                       // reference pictures and the frames in the pipeline queues.
+  enum MemoryPolicy {
+    Memory_Drop,       // release the pixels of low-entropy candidates, decode again if selected
+    Memory_Spill       // write them to a temporary file
+  } memoryPolicy;
+  enum Selection {
+    Selection_Greedy,  // max. entropy + histogram distance to the selected keyframes
+    Selection_Cluster  // k-means over the candidate histograms (for large candidate pools)
+  } selection;
+  bool rejectBlank;   // skip black/uniform frames and look for a replacement nearby
+  FileInput::Mode ioMode;
+  Decoder::SeekMode seekMode;
+  Decoder::Backend decoderBackend; // libde265 or libavcodec (worker threads: decodeThreads)
+
+  int64_t probeSize;        // limits for stream probing (bytes, seconds; 0: libavformat defaults)
+  double  analyzeDuration;
+  std::string indexCache;   // if set: stream parameters and frame index are cached in this file
+
+  std::string featureStore;  // if set: reuse the candidate features stored in this file,
+                             //         or compute and store them there
+  bool refreshFeatures;      // recompute the features even if the store is valid
+
+  SignatureIndex* signatureIndex; // if set: reject boilerplate frames known from other videos,
+                                  //         and add the signatures of this video (may be NULL)
+
+  Decoder::Position rangeStart; // only extract keyframes within this range
+  Decoder::Position rangeEnd;
+
+  bool borderCropV;   // crop black borders vertically
+  bool borderCropH;   // crop black borders horizontally
+  int  aspectH;       // crop to aspect ratio aspectH:aspectV (0: no aspect crop)
+  int  aspectV;
+
+  bool encodeJPEG;    // fill Keyframe::jpeg
+  int  jpegQuality;
+
+  bool verbose;       // log progress to stdout
+
+  /* Called for each keyframe (with its rank, starting at 1) as soon as it is
+     encoded. Without border cropping, this is right after the greedy selection
+     picked it, before the remaining candidates are ranked.
+   */
+  std::function<void(const Keyframe&, int rank)> onKeyframe;
+
+  Statistics* stats;  // timing and counters are collected here (may be NULL)
+};
+
+
+struct Keyframe
+{
+  int64_t frameNr;    // in the video (estimated with a range start, see Decoder::getIndexBase())
+  int64_t pts;
+  double  timestamp;  // seconds
+
+  double  entropy;
+  double  min_histogram_distance;
+  double  score;
+  uint64_t dhash;     // perceptual signature
+
+  FramePtr frame;     // decoded frame, in the decoder's pixel format
+  CropRect crop;      // crop area to apply to 'frame'
+
+  std::vector<uint8_t> jpeg;  // encoded (cropped) image, if requested
+};
+
+
+class KeyframeExtractor
+{
+public:
+  KeyframeExtractor();
+  ~KeyframeExtractor();
+
+  /* Extract keyframes from the video, ordered by rank.
+     Returns 0 on success, or the error code from opening the input.
+   */
+  int extract(const char* filename, const KeyframeOptions& options,
+              std::vector<Keyframe>& keyframes);
+
+  // Number of candidates evaluated in the last extract(), and whether the deadline cut it short.
+  int  getNumEvaluatedCandidates() const { return mNumEvaluated; }
+  bool wasDeadlineReached() const { return mDeadlineReached; }
+
+  // Time to open the last video (until ready for decoding), and whether the index cache was used.
+  double getOpenTime() const { return mDecoder->getOpenTime(); }
+  bool   usedIndexCache() const { return mDecoder->usedIndexCache(); }
+
+private:
+  std::unique_ptr<Decoder> mDecoder;
+  struct SwsContext* mFallbackScaler;
+  JPEGEncoder mJPEGEncoder;
+
+  std::vector<uint64_t> mSignatures; // of all decoded candidates in the current video
+
+  void placeCandidates(const Decoder&, const KeyframeOptions&, std::vector<Candidate>&);
+  void loadCandidates(Decoder&, const KeyframeOptions&, std::vector<Candidate>&);
+  void loadCandidatesPipelined(Decoder&, const KeyframeOptions&, std::vector<Candidate>&);
+  void computeCandidates(Decoder&, const KeyframeOptions&, std::vector<Candidate>&);
+  void fetchFrames(Decoder&, const KeyframeOptions&, std::vector<Candidate>&);
+  FramePtr loadFrame(Decoder&, const KeyframeOptions&, int64_t target, int64_t& position);
+
+  std::map<int64_t, FramePtr> mPreloaded;
+  bool mUsePreloaded;
+
+  FrameSpill mSpill;
+  int64_t mCandidateBytes;       // pixel data held by the candidates
+  int64_t mCandidateMemoryLimit;
+  int     mPrefetchFrames;       // options.prefetch, reduced to fit the memory limit
+
+  double mDeadlineTime;   // absolute wall clock time, 0: none
+  bool   mDeadlineReached;
+  int    mNumEvaluated;
+  double mLoadTime;       // total time for candidate loads
+  int    mNumLoadAttempts;
+
+  bool checkDeadline(const KeyframeOptions&);
+
+  void finishKeyframe(Decoder&, const KeyframeOptions&, Candidate&, std::vector<Keyframe>&);
+  void encodeKeyframes(const KeyframeOptions&, std::vector<Candidate>&, std::vector<Keyframe>&);
+
+  void limitCandidateMemory(const KeyframeOptions&, std::vector<Candidate>&);
+
+  void preloadFrames(Decoder&, const KeyframeOptions&, std::vector<int64_t> frameNrs);
+  void releasePreloadedFrames();
+};
+
+
+/* Parse a position: seconds ("90.5"), [hh:]mm:ss ("1:30") or a frame number
+   with 'f' suffix ("2250f"). Returns false on format errors.
+ */
+bool parsePosition(const char* str, Decoder::Position& pos);
+
+// Parse a size in bytes with optional K/M/G suffix ("512M"). Returns false on format errors.
+bool parseByteSize(const char* str, int64_t& bytes);
+
+// Parse an aspect ratio string like "16:9". Returns false on format errors.
+bool parseAspect(const char* aspect_str, int& aspect_h, int& aspect_v);
+
+/* Whether the output file pattern has exactly one integer conversion (like "%02d";
+   flags, width and precision allowed) and no other conversions except "%%".
+ */
+bool isValidOutputPattern(const char* pattern);
+
+/* Write the JPEG data of one keyframe to the file named by the printf pattern and 'nr'.
+   Fails for patterns that are not valid (see isValidOutputPattern()).
+ */
+bool writeKeyframeFile(const Keyframe& keyframe, const char* pattern, int nr,
+                       std::string* filename = NULL);
+
+/* Write the JPEG data of the keyframes to files named by the printf pattern
+   (numbered from 1). The file names are appended to 'filenames' if given.
+ */
+bool writeKeyframeFiles(const std::vector<Keyframe>& keyframes, const char* pattern,
+                        std::vector<std::string>* filenames = NULL);
+
+#endif
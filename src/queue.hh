@@ -0,0 +1,197 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUEUE_HH
+#define QUEUE_HH
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <stdint.h>
+
+
+/* Bounded multi-producer/multi-consumer queue connecting pipeline stages.
+
+   Lock-free ring buffer (after D. Vyukov): each cell carries a sequence number
+   telling whether it is free for the producer or filled for the consumer of the
+   current round. push() and pop() wait (spinning, then sleeping briefly) while
+   the queue is full or empty. Items should be cheap to copy (pointers, indices).
+ */
+template <class T>
+class BoundedQueue
+{
+public:
+  BoundedQueue(size_t capacity);
+
+  bool tryPush(const T& item);
+  bool tryPop(T& item);
+
+  void push(const T& item);
+
+  // Returns false when the queue was closed and is empty.
+  bool pop(T& item);
+
+  // No more items will be pushed.
+  void close() { mClosed.store(true, std::memory_order_release); }
+
+private:
+  struct Cell
+  {
+    std::atomic<size_t> sequence;
+    T item;
+  };
+
+  std::unique_ptr<Cell[]> mCells;
+  size_t mMask;
+
+  /* The producer and consumer positions are kept on separate cache lines by
+     padding (alignas(64) would not be honored for heap-allocated queues in C++11).
+   */
+  enum { CacheLineSize = 64 };
+
+  char mPad0[CacheLineSize];
+  std::atomic<size_t> mEnqueuePos;
+  char mPad1[CacheLineSize - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> mDequeuePos;
+  char mPad2[CacheLineSize - sizeof(std::atomic<size_t>)];
+  std::atomic<bool> mClosed;
+
+  static void backoff(int& spins);
+};
+
+
+template <class T>
+BoundedQueue<T>::BoundedQueue(size_t capacity)
+{
+  size_t size = 2;
+  while (size < capacity) size *= 2;
+
+  mCells.reset(new Cell[size]);
+  mMask = size-1;
+
+  for (size_t i=0;i<size;i++) {
+    mCells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  mEnqueuePos.store(0, std::memory_order_relaxed);
+  mDequeuePos.store(0, std::memory_order_relaxed);
+  mClosed.store(false, std::memory_order_relaxed);
+}
+
+
+template <class T>
+bool BoundedQueue<T>::tryPush(const T& item)
+{
+  size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+  Cell* cell;
+
+  for (;;) {
+    cell = &mCells[pos & mMask];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+    if (diff==0) {
+      if (mEnqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+    }
+    else if (diff<0) {
+      return false; // full
+    }
+    else {
+      pos = mEnqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+
+  cell->item = item;
+  cell->sequence.store(pos+1, std::memory_order_release);
+  return true;
+}
+
+
+template <class T>
+bool BoundedQueue<T>::tryPop(T& item)
+{
+  size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+  Cell* cell;
+
+  for (;;) {
+    cell = &mCells[pos & mMask];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos+1);
+
+    if (diff==0) {
+      if (mDequeuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+    }
+    else if (diff<0) {
+      return false; // empty
+    }
+    else {
+      pos = mDequeuePos.load(std::memory_order_relaxed);
+    }
+  }
+
+  item = cell->item;
+  cell->sequence.store(pos+mMask+1, std::memory_order_release);
+  return true;
+}
+
+
+template <class T>
+void BoundedQueue<T>::backoff(int& spins)
+{
+  if (spins++ < 64) {
+    std::this_thread::yield();
+  }
+  else {
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+}
+
+
+template <class T>
+void BoundedQueue<T>::push(const T& item)
+{
+  int spins=0;
+  while (!tryPush(item)) {
+    backoff(spins);
+  }
+}
+
+
+template <class T>
+bool BoundedQueue<T>::pop(T& item)
+{
+  int spins=0;
+  for (;;) {
+    if (tryPop(item)) {
+      return true;
+    }
+
+    // all pushes happened before close(), so a last attempt sees all items
+
+    if (mClosed.load(std::memory_order_acquire)) {
+      return tryPop(item);
+    }
+
+    backoff(spins);
+  }
+}
+
+#endif
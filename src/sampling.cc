@@ -0,0 +1,256 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sampling.hh"
+#include "libcvalgo/histogram_diff.hh"
+#include <algorithm>
+#include <string.h>
+
+
+std::vector<int64_t> refinementFrames(const std::vector<Candidate>& candidates, int maxNew)
+{
+  struct Interval
+  {
+    int64_t first, last;
+    double  distance;
+  };
+
+  std::vector<Interval> intervals;
+
+  cvalgo::HistogramDiff_AbsoluteError histDiff;
+
+  for (size_t i=1;i<candidates.size();i++) {
+    const Candidate& a = candidates[i-1];
+    const Candidate& b = candidates[i];
+
+    if (b.frameNr - a.frameNr < 2) {
+      continue; // no frame in between
+    }
+
+    Interval iv;
+    iv.first = a.frameNr;
+    iv.last  = b.frameNr;
+    iv.distance = histDiff.Diff(a.histogram, b.histogram);
+    intervals.push_back(iv);
+  }
+
+
+  // refine the intervals with the largest content change (at most half of them per
+  // round, such that the next round can look at the new distances again)
+
+  std::sort(intervals.begin(), intervals.end(),
+            [](const Interval& a, const Interval& b) {
+              if (a.distance != b.distance) return a.distance > b.distance;
+              return (a.last-a.first) > (b.last-b.first);
+            });
+
+  int nRefine = std::min<int>(maxNew, (intervals.size()+1)/2);
+
+  std::vector<int64_t> frames;
+  for (int i=0;i<nRefine;i++) {
+    frames.push_back((intervals[i].first + intervals[i].last) / 2);
+  }
+
+  std::sort(frames.begin(), frames.end());
+
+  return frames;
+}
+
+
+std::vector<std::vector<int64_t> > bisectionLevels(const std::vector<int64_t>& frames)
+{
+  std::vector<std::vector<int64_t> > levels;
+
+  // intervals [first;last) of indices still to be split
+
+  std::vector<std::pair<size_t,size_t> > intervals;
+  intervals.push_back(std::make_pair(size_t(0), frames.size()));
+
+  while (!intervals.empty()) {
+    std::vector<int64_t> level;
+    std::vector<std::pair<size_t,size_t> > next;
+
+    for (const auto& iv : intervals) {
+      if (iv.first >= iv.second) {
+        continue;
+      }
+
+      size_t mid = (iv.first + iv.second) / 2;
+      level.push_back(frames[mid]);
+
+      next.push_back(std::make_pair(iv.first, mid));
+      next.push_back(std::make_pair(mid+1, iv.second));
+    }
+
+    if (!level.empty()) {
+      levels.push_back(level);
+    }
+
+    intervals.swap(next);
+  }
+
+  return levels;
+}
+
+
+// --- samplers ---
+
+uint64_t SeededRandom::next()
+{
+  uint64_t z = (mState += UINT64_C(0x9E3779B97F4A7C15));
+  z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+  return z ^ (z >> 31);
+}
+
+
+class UniformSampler : public Sampler
+{
+public:
+  std::vector<int64_t> sample(int64_t firstFrame, int64_t nFrames, int nCandidates)
+  {
+    std::vector<int64_t> frames;
+    for (int i=0;i<nCandidates;i++) {
+      frames.push_back(firstFrame + (i+1)*nFrames/(nCandidates+1));
+    }
+
+    frames.erase(std::unique(frames.begin(), frames.end()), frames.end());
+    return frames;
+  }
+};
+
+
+class StratifiedSampler : public Sampler
+{
+public:
+  StratifiedSampler(uint64_t seed) : mRandom(seed) { }
+
+  std::vector<int64_t> sample(int64_t firstFrame, int64_t nFrames, int nCandidates)
+  {
+    nCandidates = std::min<int64_t>(nCandidates, nFrames);
+
+    std::vector<int64_t> frames;
+    for (int i=0;i<nCandidates;i++) {
+      int64_t begin = i*nFrames/nCandidates;
+      int64_t end   = (i+1)*nFrames/nCandidates;
+      frames.push_back(firstFrame + begin + mRandom.below(end-begin));
+    }
+
+    return frames;
+  }
+
+private:
+  SeededRandom mRandom;
+};
+
+
+class JitteredSampler : public Sampler
+{
+public:
+  JitteredSampler(uint64_t seed) : mRandom(seed) { }
+
+  std::vector<int64_t> sample(int64_t firstFrame, int64_t nFrames, int nCandidates)
+  {
+    nCandidates = std::min<int64_t>(nCandidates, nFrames);
+
+    // the uniform positions, each displaced within its own stratum
+
+    int64_t stratum = nFrames/(nCandidates+1);
+
+    std::vector<int64_t> frames;
+    for (int i=0;i<nCandidates;i++) {
+      int64_t f = (i+1)*nFrames/(nCandidates+1);
+      f += mRandom.below(stratum+1) - stratum/2;
+      frames.push_back(firstFrame + std::min(std::max(f,(int64_t)0), nFrames-1));
+    }
+
+    frames.erase(std::unique(frames.begin(), frames.end()), frames.end());
+    return frames;
+  }
+
+private:
+  SeededRandom mRandom;
+};
+
+
+class KeyframeSampler : public Sampler
+{
+public:
+  KeyframeSampler(const std::vector<int64_t>* keyframes) : mKeyframes(keyframes) { }
+
+  std::vector<int64_t> sample(int64_t firstFrame, int64_t nFrames, int nCandidates)
+  {
+    std::vector<int64_t> frames = UniformSampler().sample(firstFrame, nFrames, nCandidates);
+
+    const std::vector<int64_t>& keys = *mKeyframes;
+
+    for (int64_t& f : frames) {
+      auto after = std::lower_bound(keys.begin(), keys.end(), f);
+
+      // nearest keyframe within the range, if any
+
+      int64_t best = f;
+      int64_t bestDist = nFrames;
+      if (after != keys.end() && *after < firstFrame+nFrames) {
+        best = *after;
+        bestDist = *after - f;
+      }
+      if (after != keys.begin() && *(after-1) >= firstFrame && f - *(after-1) < bestDist) {
+        best = *(after-1);
+      }
+
+      f = best;
+    }
+
+    frames.erase(std::unique(frames.begin(), frames.end()), frames.end());
+    return frames;
+  }
+
+private:
+  const std::vector<int64_t>* mKeyframes;
+};
+
+
+bool parseSamplerType(const char* name, SamplerType& type)
+{
+  if      (strcmp(name,"uniform")==0)    { type = Sampler_Uniform; }
+  else if (strcmp(name,"stratified")==0) { type = Sampler_Stratified; }
+  else if (strcmp(name,"jittered")==0)   { type = Sampler_Jittered; }
+  else if (strcmp(name,"keyframes")==0)  { type = Sampler_Keyframes; }
+  else {
+    return false;
+  }
+
+  return true;
+}
+
+
+Sampler* createSampler(SamplerType type, uint64_t seed,
+                       const std::vector<int64_t>* keyframes)
+{
+  switch (type) {
+  case Sampler_Stratified: return new StratifiedSampler(seed);
+  case Sampler_Jittered:   return new JitteredSampler(seed);
+  case Sampler_Keyframes:  if (keyframes) return new KeyframeSampler(keyframes);
+                           // fall through
+  case Sampler_Uniform:
+  default:                 return new UniformSampler;
+  }
+}
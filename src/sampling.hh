@@ -0,0 +1,90 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SAMPLING_HH
+#define SAMPLING_HH
+
+#include <vector>
+#include <stdint.h>
+#include "selection.hh"
+
+
+/* Deterministic pseudo random numbers (splitmix64): the same seed gives the
+   same candidates on every platform.
+ */
+class SeededRandom
+{
+public:
+  explicit SeededRandom(uint64_t seed) : mState(seed) { }
+
+  uint64_t next();
+
+  // uniform in [0;n)
+  int64_t below(int64_t n) { return n>0 ? (int64_t)(next() % (uint64_t)n) : 0; }
+
+private:
+  uint64_t mState;
+};
+
+
+/* Candidate placement. A sampler returns at most nCandidates distinct, sorted
+   frame numbers from [firstFrame; firstFrame+nFrames), in O(nCandidates) time and
+   memory (keyframe alignment adds a binary search per candidate).
+ */
+class Sampler
+{
+public:
+  virtual ~Sampler() { }
+
+  virtual std::vector<int64_t> sample(int64_t firstFrame, int64_t nFrames, int nCandidates) = 0;
+};
+
+
+enum SamplerType
+{
+  Sampler_Uniform,     // evenly spaced
+  Sampler_Stratified,  // one random frame in each of nCandidates equal strata
+  Sampler_Jittered,    // evenly spaced, randomly displaced by up to half a stratum
+  Sampler_Keyframes    // evenly spaced, moved to the nearest keyframe (no decoding after the seek)
+};
+
+bool parseSamplerType(const char* name, SamplerType& type);
+
+/* 'keyframes' (sorted frame numbers) is required for Sampler_Keyframes and
+   must stay valid while the sampler is used.
+ */
+Sampler* createSampler(SamplerType type, uint64_t seed,
+                       const std::vector<int64_t>* keyframes = NULL);
+
+
+/* Coarse-to-fine sampling: returns up to 'maxNew' frame numbers in the middle
+   of the intervals between neighbouring candidates whose histograms differ most.
+   'candidates' must be loaded and sorted by frame number.
+   Intervals without a frame in between are not refined further.
+ */
+std::vector<int64_t> refinementFrames(const std::vector<Candidate>& candidates, int maxNew);
+
+/* Coarse-to-fine order of the (sorted) frames by bisecting the index range:
+   level 0 is the middle frame, each further level the middles of the intervals
+   left by the previous levels. Every prefix of levels covers the whole range evenly.
+ */
+std::vector<std::vector<int64_t> > bisectionLevels(const std::vector<int64_t>& frames);
+
+#endif
@@ -0,0 +1,371 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selection.hh"
+#include "sampling.hh"
+#include "libcvalgo/histogram_diff.hh"
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <limits>
+#include <math.h>
+
+
+static void histogramFeatures(const cvalgo::Histogram& h, double* features)
+{
+  double total = h.TotalSum();
+  if (total<=0) total=1;
+
+  for (int b=0;b<=h.HighVal()-h.LowVal();b++) {
+    features[b] = h[h.LowVal()+b] / total;
+  }
+}
+
+
+// L1 distance of normalized histograms, halved like HistogramDiff_AbsoluteError
+static double featureDistance(const double* a, const double* b, int n)
+{
+  double d=0;
+  for (int i=0;i<n;i++) {
+    d += fabs(a[i]-b[i]);
+  }
+  return d/2;
+}
+
+
+void selectKeyframes(std::vector<Candidate>& candidates,
+                     std::vector<Candidate>& keyframes,
+                     const SelectionCallback& onSelected)
+{
+  if (candidates.empty()) {
+    return;
+  }
+
+  // Each candidate keeps its distance to the nearest selected keyframe. In each round,
+  // it is only updated with the newly selected keyframe.
+
+  const cvalgo::Histogram& h0 = candidates[0].histogram;
+  const int nBins = h0.HighVal() - h0.LowVal() + 1;
+
+  std::vector<double> features(candidates.size() * nBins);
+  for (size_t i=0;i<candidates.size();i++) {
+    histogramFeatures(candidates[i].histogram, &features[i*nBins]);
+    candidates[i].min_histogram_distance = 1.0;
+  }
+
+  std::vector<double> keyFeatures(nBins);
+  for (const Candidate& k : keyframes) {
+    histogramFeatures(k.histogram, keyFeatures.data());
+
+    for (size_t i=0;i<candidates.size();i++) {
+      double dist = featureDistance(keyFeatures.data(), &features[i*nBins], nBins);
+      candidates[i].min_histogram_distance = std::min(candidates[i].min_histogram_distance, dist);
+    }
+  }
+
+
+  std::vector<size_t> remaining(candidates.size());
+  for (size_t i=0;i<remaining.size();i++) {
+    remaining[i] = i;
+  }
+
+  while (!remaining.empty()) {
+
+    // --- select the candidate with the highest score ---
+
+    size_t best = 0;
+    for (size_t r=0;r<remaining.size();r++) {
+      Candidate& c = candidates[remaining[r]];
+      c.score = c.entropy + c.min_histogram_distance;
+
+      if (c.score >= candidates[remaining[best]].score) {
+        best = r;
+      }
+    }
+
+    size_t selected = remaining[best];
+    remaining[best] = remaining.back();
+    remaining.pop_back();
+
+    keyframes.push_back(candidates[selected]);
+
+    if (onSelected) {
+      onSelected(keyframes.back());
+    }
+
+
+    // --- update the min. distances with the new keyframe ---
+
+    const double* key = &features[selected*nBins];
+
+    for (size_t r : remaining) {
+      Candidate& c = candidates[r];
+      double dist = featureDistance(key, &features[r*nBins], nBins);
+      if (dist < c.min_histogram_distance) {
+        c.min_histogram_distance = dist;
+      }
+    }
+  }
+
+  candidates.clear();
+}
+
+
+
+// --- clustering ---
+
+namespace {
+
+  // Histograms as flat, normalized feature vectors.
+
+  struct FeatureMatrix
+  {
+    int nBins;
+    std::vector<float> data;
+
+    const float* row(int i) const { return &data[i*nBins]; }
+  };
+
+
+  float distanceL1(const float* a, const float* b, int n)
+  {
+    float d=0;
+    for (int i=0;i<n;i++) {
+      d += fabsf(a[i]-b[i]);
+    }
+    return d;
+  }
+
+
+  void buildFeatures(const std::vector<Candidate>& candidates, FeatureMatrix& features)
+  {
+    const cvalgo::Histogram& h0 = candidates[0].histogram;
+    features.nBins = h0.HighVal() - h0.LowVal() + 1;
+    features.data.resize(candidates.size() * features.nBins);
+
+    for (int i=0;i<candidates.size();i++) {
+      const cvalgo::Histogram& h = candidates[i].histogram;
+      double total = h.TotalSum();
+      if (total<=0) total=1;
+
+      float* out = &features.data[i*features.nBins];
+      for (int b=0;b<features.nBins;b++) {
+        out[b] = h[h.LowVal()+b] / total;
+      }
+    }
+  }
+
+
+  // k-means++: each further center is drawn with probability proportional to its distance
+
+  void seedCenters(const FeatureMatrix& features, int nPoints, int k,
+                   SeededRandom& random, std::vector<float>& centers)
+  {
+    int nBins = features.nBins;
+    centers.resize(k*nBins);
+
+    std::vector<float> minDist(nPoints, std::numeric_limits<float>::max());
+
+    int pick = random.below(nPoints);
+
+    for (int c=0;c<k;c++) {
+      std::copy(features.row(pick), features.row(pick)+nBins, &centers[c*nBins]);
+
+      double sum=0;
+      for (int i=0;i<nPoints;i++) {
+        minDist[i] = std::min(minDist[i], distanceL1(features.row(i), &centers[c*nBins], nBins));
+        sum += minDist[i];
+      }
+
+      if (sum<=0) {
+        pick = random.below(nPoints); // all points covered, duplicates do not matter
+        continue;
+      }
+
+      double r = (random.next() >> 11) * (1.0/9007199254740992.0) * sum;
+      pick = nPoints-1;
+      for (int i=0;i<nPoints;i++) {
+        r -= minDist[i];
+        if (r<0) { pick=i; break; }
+      }
+    }
+  }
+
+
+  // Assign each point to its nearest center. Returns the number of changed assignments.
+
+  int assignPoints(const FeatureMatrix& features, int nPoints,
+                   const std::vector<float>& centers, int k,
+                   std::vector<int>& assignment, int nThreads)
+  {
+    std::vector<int> changed(nThreads, 0);
+
+    auto assignRange = [&](int thread) {
+      int begin = (int64_t)thread   *nPoints/nThreads;
+      int end   = (int64_t)(thread+1)*nPoints/nThreads;
+
+      for (int i=begin;i<end;i++) {
+        int   best = 0;
+        float bestDist = std::numeric_limits<float>::max();
+
+        for (int c=0;c<k;c++) {
+          float d = distanceL1(features.row(i), &centers[c*features.nBins], features.nBins);
+          if (d<bestDist) { bestDist=d; best=c; }
+        }
+
+        if (assignment[i] != best) {
+          assignment[i] = best;
+          changed[thread]++;
+        }
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t=1;t<nThreads;t++) {
+      threads.push_back(std::thread(assignRange, t));
+    }
+    assignRange(0);
+
+    for (auto& t : threads) {
+      t.join();
+    }
+
+    int nChanged=0;
+    for (int n : changed) nChanged+=n;
+    return nChanged;
+  }
+
+
+  void updateCenters(const FeatureMatrix& features, int nPoints,
+                     const std::vector<int>& assignment, int k,
+                     std::vector<float>& centers)
+  {
+    int nBins = features.nBins;
+
+    std::vector<float> sums(k*nBins, 0);
+    std::vector<int>   counts(k, 0);
+
+    for (int i=0;i<nPoints;i++) {
+      float* sum = &sums[assignment[i]*nBins];
+      const float* x = features.row(i);
+      for (int b=0;b<nBins;b++) {
+        sum[b] += x[b];
+      }
+      counts[assignment[i]]++;
+    }
+
+    // empty clusters keep their previous center
+
+    for (int c=0;c<k;c++) {
+      if (counts[c]>0) {
+        for (int b=0;b<nBins;b++) {
+          centers[c*nBins+b] = sums[c*nBins+b] / counts[c];
+        }
+      }
+    }
+  }
+}
+
+
+void clusterKeyframes(std::vector<Candidate>& candidates,
+                      std::vector<Candidate>& keyframes,
+                      int nClusters, int nThreads, uint64_t seed,
+                      const SelectionCallback& onSelected)
+{
+  int nPoints = candidates.size();
+
+  if (nClusters<=0 || nPoints<=nClusters) {
+    selectKeyframes(candidates, keyframes, onSelected);
+    return;
+  }
+
+  if (nThreads<=0) {
+    nThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+  }
+  nThreads = std::min(nThreads, std::max(nPoints/256, 1)); // not worth a thread for less
+
+
+  // --- k-means ---
+
+  const int MaxIterations = 20;
+
+  FeatureMatrix features;
+  buildFeatures(candidates, features);
+
+  SeededRandom random(seed);
+  std::vector<float> centers;
+  seedCenters(features, nPoints, nClusters, random, centers);
+
+  std::vector<int> assignment(nPoints, -1);
+
+  for (int iter=0;iter<MaxIterations;iter++) {
+    if (assignPoints(features, nPoints, centers, nClusters, assignment, nThreads)==0) {
+      break;
+    }
+
+    updateCenters(features, nPoints, assignment, nClusters, centers);
+  }
+
+
+  // --- highest-entropy member of each cluster ---
+
+  std::vector<int> representative(nClusters, -1);
+
+  for (int i=0;i<nPoints;i++) {
+    int& r = representative[assignment[i]];
+    if (r<0 || candidates[i].entropy > candidates[r].entropy) {
+      r = i;
+    }
+  }
+
+  std::vector<Candidate> selected;
+  std::vector<Candidate> others;
+
+  std::vector<bool> isRepresentative(nPoints, false);
+  for (int r : representative) {
+    if (r>=0) isRepresentative[r]=true;
+  }
+
+  for (int i=0;i<nPoints;i++) {
+    if (isRepresentative[i]) selected.push_back(candidates[i]);
+    else                     others.push_back(candidates[i]);
+  }
+
+  candidates.clear();
+
+
+  // --- ranking: representatives by greedy selection, then the rest by entropy ---
+
+  selectKeyframes(selected, keyframes, onSelected);
+
+  std::sort(others.begin(), others.end(),
+            [](const Candidate& a, const Candidate& b) { return a.entropy > b.entropy; });
+
+  for (Candidate& c : others) {
+    c.score = c.entropy;
+    c.min_histogram_distance = 0;
+
+    keyframes.push_back(c);
+
+    if (onSelected) {
+      onSelected(keyframes.back());
+    }
+  }
+}
@@ -0,0 +1,83 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SELECTION_HH
+#define SELECTION_HH
+
+#include <vector>
+#include <functional>
+#include "features.hh"
+
+
+struct Candidate
+{
+  Candidate() : frameNr(0), width(0), height(0), dhash(0), pts(0), timestamp(0),
+                entropy(0), min_histogram_distance(0), score(0),
+                loaded(false), spillOffset(-1) { }
+
+  int64_t frameNr;
+  FramePtr frame;     // may be empty if the features were read from a feature store,
+                      // or if the pixels were dropped/spilled to stay within the memory limit
+  int width, height;
+  CropRect crop;
+
+  cvalgo::Histogram histogram;
+  uint64_t dhash;
+  std::vector<uint8_t> rowMeans, colMeans;  // luma projections (see calcProjections())
+
+  int64_t pts;
+  double timestamp;
+
+  double entropy;
+  double min_histogram_distance;
+
+  double score;
+
+  bool    loaded;      // features computed
+  int64_t spillOffset; // position in the spill file, or -1
+};
+
+
+typedef std::function<void(Candidate&)> SelectionCallback;
+
+/* Greedy keyframe selection. Repeatedly moves the candidate with the highest
+   score (entropy + histogram distance to the already selected keyframes)
+   from 'candidates' to 'keyframes', until all candidates are ranked.
+   'onSelected' is called for each keyframe right after it was selected.
+   Each round updates the distances only with the newly selected keyframe,
+   thus the run time is O(candidates^2).
+ */
+void selectKeyframes(std::vector<Candidate>& candidates,
+                     std::vector<Candidate>& keyframes,
+                     const SelectionCallback& onSelected = SelectionCallback());
+
+/* Clustering selection for large candidate pools. The candidate histograms are
+   grouped into 'nClusters' clusters with k-means (k-means++ seeding, L1 distance,
+   assignment step spread over 'nThreads' threads, 0: all cores). The highest-entropy
+   member of each cluster becomes a keyframe; these are ranked among each other by
+   the greedy selection and followed by the remaining candidates by entropy.
+   Run time is O(iterations * candidates * nClusters).
+ */
+void clusterKeyframes(std::vector<Candidate>& candidates,
+                      std::vector<Candidate>& keyframes,
+                      int nClusters, int nThreads, uint64_t seed,
+                      const SelectionCallback& onSelected = SelectionCallback());
+
+#endif
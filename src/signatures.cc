@@ -0,0 +1,384 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "signatures.hh"
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+
+static const char IndexMagic[8] = { 'K','F','S','I','G','I','D','X' };
+static const uint32_t IndexVersion = 2;
+
+
+SignatureIndex::SignatureIndex()
+{
+  mFd = -1;
+  mHeader = NULL;
+  mVideoKeys = NULL;
+  mEntries = NULL;
+  mMapSize = 0;
+  mNumIndexed = 0;
+
+  mMinVideos = 3;
+  mMaxDistance = 8;
+}
+
+
+SignatureIndex::~SignatureIndex()
+{
+  close();
+}
+
+
+bool SignatureIndex::open(const char* filename)
+{
+  close();
+
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  mFd = ::open(filename, O_RDWR | O_CREAT, 0644);
+  if (mFd<0) {
+    return false;
+  }
+
+  flock(mFd, LOCK_EX);
+
+  struct stat st;
+  bool ok = (fstat(mFd, &st)==0);
+
+  if (ok && st.st_size==0) {
+    // new index file
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IndexMagic, sizeof(IndexMagic));
+    header.version = IndexVersion;
+    header.capacity = 1024;
+    header.videoCapacity = 256;
+
+    ok = (pwrite(mFd, &header, sizeof(header), 0) == sizeof(header) &&
+          ftruncate(mFd, sizeof(Header) + header.videoCapacity*sizeof(uint64_t)
+                                        + header.capacity*sizeof(Entry)) == 0);
+  }
+
+  ok = ok && mapFile();
+
+  ok = ok && (memcmp(mHeader->magic, IndexMagic, sizeof(IndexMagic))==0 &&
+              mHeader->version == IndexVersion);
+
+  flock(mFd, LOCK_UN);
+
+  if (!ok) {
+    if (mHeader) {
+      munmap(mHeader, mMapSize);
+      mHeader = NULL;
+    }
+    ::close(mFd);
+    mFd = -1;
+    return false;
+  }
+
+  indexNewEntries();
+
+  return true;
+}
+
+
+void SignatureIndex::close()
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  if (mHeader) {
+    munmap(mHeader, mMapSize);
+    mHeader = NULL;
+    mVideoKeys = NULL;
+    mEntries = NULL;
+  }
+
+  if (mFd>=0) {
+    ::close(mFd);
+    mFd = -1;
+  }
+
+  for (int b=0;b<NBands;b++) {
+    mBuckets[b].clear();
+  }
+
+  mNumIndexed = 0;
+}
+
+
+// Map the whole file, with its current size.
+
+bool SignatureIndex::mapFile()
+{
+  struct stat st;
+  if (fstat(mFd, &st)<0 || st.st_size < (off_t)sizeof(Header)) {
+    return false;
+  }
+
+  if (mHeader && (size_t)st.st_size != mMapSize) {
+    munmap(mHeader, mMapSize);
+    mHeader = NULL;
+  }
+
+  if (!mHeader) {
+    void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+
+    mMapSize = st.st_size;
+    mHeader  = (Header*)map;
+  }
+
+  // the entries follow the video key table, which may have been enlarged in the meantime
+
+  mVideoKeys = (uint64_t*)(mHeader+1);
+  mEntries = (Entry*)(mVideoKeys + mHeader->videoCapacity);
+
+  if (sizeof(Header) + mHeader->videoCapacity*sizeof(uint64_t) +
+      mHeader->capacity*sizeof(Entry) > mMapSize) {
+    return false; // broken file
+  }
+
+  return true;
+}
+
+
+bool SignatureIndex::grow(uint64_t capacity)
+{
+  if (ftruncate(mFd, sizeof(Header) + mHeader->videoCapacity*sizeof(uint64_t)
+                                    + capacity*sizeof(Entry)) != 0) {
+    return false;
+  }
+
+  mHeader->capacity = capacity; // written through the old mapping, which stays valid until remapped
+
+  return mapFile();
+}
+
+
+// Enlarge the video key table. The entries behind it are moved up.
+
+bool SignatureIndex::growVideos(uint64_t videoCapacity)
+{
+  if (ftruncate(mFd, sizeof(Header) + videoCapacity*sizeof(uint64_t)
+                                    + mHeader->capacity*sizeof(Entry)) != 0) {
+    return false;
+  }
+
+  // map the enlarged file with the old layout, then move the entries
+
+  if (!mapFile()) {
+    return false;
+  }
+
+  Entry* newEntries = (Entry*)(mVideoKeys + videoCapacity);
+  memmove(newEntries, mEntries, mHeader->nEntries*sizeof(Entry));
+
+  mHeader->videoCapacity = videoCapacity;
+  mEntries = newEntries;
+
+  return true;
+}
+
+
+bool SignatureIndex::hasVideo(uint64_t videoKey) const
+{
+  for (uint64_t i=0;i<mHeader->nVideoKeys;i++) {
+    if (mVideoKeys[i] == videoKey) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+uint64_t SignatureIndex::videoKey(const char* filename)
+{
+  char path[PATH_MAX];
+  struct stat st;
+
+  if (realpath(filename, path)==NULL || stat(path, &st)!=0) {
+    return 0;
+  }
+
+  // FNV-1a over the path, the size and the modification time
+
+  uint64_t key = 14695981039346656037ULL;
+  auto add = [&key](const void* data, size_t n) {
+    for (size_t i=0;i<n;i++) {
+      key ^= ((const uint8_t*)data)[i];
+      key *= 1099511628211ULL;
+    }
+  };
+
+  int64_t size  = st.st_size;
+  int64_t mtime = st.st_mtime;
+
+  add(path, strlen(path));
+  add(&size, sizeof(size));
+  add(&mtime, sizeof(mtime));
+
+  return key ? key : 1;
+}
+
+
+// Insert entries appended since the last call (possibly by other processes) into the buckets.
+
+void SignatureIndex::indexNewEntries()
+{
+  for (; mNumIndexed < mHeader->nEntries; mNumIndexed++) {
+    uint64_t signature = mEntries[mNumIndexed].signature;
+
+    for (int b=0;b<NBands;b++) {
+      mBuckets[b][(uint16_t)(signature >> (16*b))].push_back(mNumIndexed);
+    }
+  }
+}
+
+
+int64_t SignatureIndex::findNearest(uint64_t signature) const
+{
+  int64_t best = -1;
+  int bestDistance = mMaxDistance+1;
+
+  for (int b=0;b<NBands;b++) {
+    auto bucket = mBuckets[b].find((uint16_t)(signature >> (16*b)));
+    if (bucket == mBuckets[b].end()) {
+      continue;
+    }
+
+    for (uint32_t idx : bucket->second) {
+      int d = hammingDistance(signature, mEntries[idx].signature);
+      if (d < bestDistance) {
+        bestDistance = d;
+        best = idx;
+      }
+    }
+  }
+
+  return best;
+}
+
+
+bool SignatureIndex::isBoilerplate(uint64_t signature)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  if (mFd<0) {
+    return false;
+  }
+
+  // another process enlarged the video key table and moved the entries
+
+  if (mEntries != (Entry*)(mVideoKeys + mHeader->videoCapacity)) {
+    flock(mFd, LOCK_SH);
+    bool ok = mapFile();
+    flock(mFd, LOCK_UN);
+
+    if (!ok) {
+      return false;
+    }
+  }
+
+  int64_t idx = findNearest(signature);
+
+  return idx>=0 && (int)mEntries[idx].nVideos >= mMinVideos;
+}
+
+
+bool SignatureIndex::addVideo(const std::vector<uint64_t>& signatures, uint64_t videoKey)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  if (mFd<0) {
+    return false;
+  }
+
+  flock(mFd, LOCK_EX);
+
+  // pick up changes made by other processes
+
+  if (!mapFile()) {
+    flock(mFd, LOCK_UN);
+    return false;
+  }
+
+  indexNewEntries();
+
+
+  // each video is counted only once (e.g. when a job is repeated)
+
+  if (videoKey != 0) {
+    if (hasVideo(videoKey)) {
+      flock(mFd, LOCK_UN);
+      return false;
+    }
+
+    if (mHeader->nVideoKeys == mHeader->videoCapacity &&
+        !growVideos(mHeader->videoCapacity*2)) {
+      flock(mFd, LOCK_UN);
+      return false;
+    }
+
+    mVideoKeys[mHeader->nVideoKeys++] = videoKey;
+  }
+
+  uint32_t videoId = ++mHeader->nVideos;
+
+  for (uint64_t signature : signatures) {
+    int64_t idx = findNearest(signature);
+
+    if (idx>=0) {
+      Entry& e = mEntries[idx];
+      if (e.lastVideo != videoId) {
+        e.nVideos++;
+        e.lastVideo = videoId;
+      }
+    }
+    else {
+      if (mHeader->nEntries == mHeader->capacity &&
+          !grow(mHeader->capacity*2)) {
+        break;
+      }
+
+      Entry& e = mEntries[mHeader->nEntries];
+      e.signature = signature;
+      e.nVideos = 1;
+      e.lastVideo = videoId;
+
+      mHeader->nEntries++;
+      indexNewEntries();
+    }
+  }
+
+  flock(mFd, LOCK_UN);
+
+  return true;
+}
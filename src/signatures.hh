@@ -0,0 +1,119 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIGNATURES_HH
+#define SIGNATURES_HH
+
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <stdint.h>
+
+
+/* Persistent index of perceptual frame signatures (64-bit dHash), shared
+   between videos to recognize recurring intros, logos and ads.
+
+   The entries are kept in a memory-mapped file. For each signature, the index
+   counts in how many different videos it was seen. A signature found in at least
+   'minVideos' videos is considered boilerplate. The index also keeps a key for
+   each registered video, such that processing a video again does not count it twice.
+
+   Lookup is by Hamming distance, using LSH on 4 bands of 16 bits: every entry
+   is listed in one bucket per band and only entries sharing at least one band
+   with the query are compared. This finds all matches with up to 3 differing
+   bits, and most of the matches with larger distances.
+
+   The index can be used from several threads. Concurrent processes are
+   synchronized with flock() when adding videos.
+ */
+class SignatureIndex
+{
+public:
+  SignatureIndex();
+  ~SignatureIndex();
+
+  bool open(const char* filename); // created if it does not exist
+  void close();
+
+  bool isOpen() const { return mFd >= 0; }
+
+  void setMinVideos(int n) { mMinVideos = n; }
+  void setMaxDistance(int bits) { mMaxDistance = bits; }
+
+  // Whether a similar signature was seen in at least 'minVideos' videos.
+  bool isBoilerplate(uint64_t signature);
+
+  /* Register the signatures of one video, identified by 'videoKey' (see videoKey()).
+     Videos registered before are skipped. Returns false if the video was skipped.
+   */
+  bool addVideo(const std::vector<uint64_t>& signatures, uint64_t videoKey);
+
+  // Key of a video file from its absolute path, size and modification time (0 on error).
+  static uint64_t videoKey(const char* filename);
+
+  static int hammingDistance(uint64_t a, uint64_t b) { return __builtin_popcountll(a^b); }
+
+private:
+  struct Header
+  {
+    char     magic[8];
+    uint32_t version;
+    uint32_t nVideos;
+    uint64_t nEntries;
+    uint64_t capacity;
+    uint64_t nVideoKeys;
+    uint64_t videoCapacity;
+  };
+
+  // File layout: Header, uint64_t videoKeys[videoCapacity], Entry entries[capacity]
+
+  struct Entry
+  {
+    uint64_t signature;
+    uint32_t nVideos;
+    uint32_t lastVideo;  // to count each video only once
+  };
+
+  enum { NBands = 4 };
+
+  int  mFd;
+  Header* mHeader;
+  uint64_t* mVideoKeys;
+  Entry*  mEntries;
+  size_t  mMapSize;
+
+  uint64_t mNumIndexed;  // entries already inserted into the buckets
+
+  int mMinVideos;
+  int mMaxDistance;
+
+  std::unordered_map<uint16_t, std::vector<uint32_t> > mBuckets[NBands];
+
+  std::mutex mMutex;
+
+  bool mapFile();
+  bool grow(uint64_t capacity);
+  bool growVideos(uint64_t videoCapacity);
+  bool hasVideo(uint64_t videoKey) const;
+  void indexNewEntries();
+  int64_t findNearest(uint64_t signature) const;
+};
+
+#endif
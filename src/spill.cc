@@ -0,0 +1,140 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spill.hh"
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "libavutil/imgutils.h"
+}
+
+
+struct SpillHeader
+{
+  int32_t format;
+  int32_t width, height;
+  int32_t size;
+};
+
+
+FrameSpill::FrameSpill()
+{
+  mFile = NULL;
+  mSize = 0;
+}
+
+
+FrameSpill::~FrameSpill()
+{
+  if (mFile) {
+    fclose(mFile);
+  }
+}
+
+
+int64_t FrameSpill::store(const AVFrame* frame)
+{
+  if (mFile==NULL) {
+    mFile = tmpfile();
+    if (mFile==NULL) {
+      return -1;
+    }
+  }
+
+  SpillHeader header;
+  header.format = frame->format;
+  header.width  = frame->width;
+  header.height = frame->height;
+  header.size   = frameBytes(frame);
+
+  if (header.size <= 0) {
+    return -1;
+  }
+
+  std::vector<uint8_t> buffer(header.size);
+  av_image_copy_to_buffer(buffer.data(), header.size,
+                          frame->data, frame->linesize,
+                          (enum AVPixelFormat)frame->format,
+                          frame->width, frame->height, 1);
+
+  int64_t offset = mSize;
+
+  if (fseeko(mFile, offset, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(header), 1, mFile) != 1 ||
+      fwrite(buffer.data(), header.size, 1, mFile) != 1) {
+    return -1;
+  }
+
+  mSize += sizeof(header) + header.size;
+
+  return offset;
+}
+
+
+FramePtr FrameSpill::load(int64_t offset)
+{
+  SpillHeader header;
+
+  if (mFile==NULL ||
+      fseeko(mFile, offset, SEEK_SET) != 0 ||
+      fread(&header, sizeof(header), 1, mFile) != 1) {
+    return FramePtr();
+  }
+
+  std::vector<uint8_t> buffer(header.size);
+  if (fread(buffer.data(), header.size, 1, mFile) != 1) {
+    return FramePtr();
+  }
+
+  AVFrame* frame = av_frame_alloc();
+  frame->format = header.format;
+  frame->width  = header.width;
+  frame->height = header.height;
+
+  if (av_frame_get_buffer(frame, 32) < 0) {
+    av_frame_free(&frame);
+    return FramePtr();
+  }
+
+  uint8_t* src[4];
+  int srcLinesize[4];
+  av_image_fill_arrays(src, srcLinesize, buffer.data(),
+                       (enum AVPixelFormat)header.format, header.width, header.height, 1);
+
+  av_image_copy(frame->data, frame->linesize, (const uint8_t**)src, srcLinesize,
+                (enum AVPixelFormat)header.format, header.width, header.height);
+
+  return makeFramePtr(frame);
+}
+
+
+void FrameSpill::clear()
+{
+  if (mFile) {
+    fflush(mFile);
+    if (ftruncate(fileno(mFile), 0) != 0) {
+      fclose(mFile); // start with a new file
+      mFile = NULL;
+    }
+  }
+
+  mSize = 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPILL_HH
+#define SPILL_HH
+
+#include <stdio.h>
+#include <stdint.h>
+#include "features.hh"
+
+
+/* Temporary file for frames that do not fit into the memory budget.
+   The pixel data is stored unpadded, in the frame's own format. The staging
+   buffer for this exists only during store() and load(), such that it does not
+   add an uncounted frame to the memory budget.
+   The file is removed automatically when it is closed.
+ */
+class FrameSpill
+{
+public:
+  FrameSpill();
+  ~FrameSpill();
+
+  // Returns the offset of the stored frame, or -1 on error.
+  int64_t store(const AVFrame* frame);
+
+  // Read back a stored frame (empty on error).
+  FramePtr load(int64_t offset);
+
+  // Discard all stored frames.
+  void clear();
+
+private:
+  FILE*   mFile;
+  int64_t mSize;
+};
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.hh"
+#include "json.hh"
+#include <time.h>
+#include <sys/resource.h>
+#include <algorithm>
+
+
+double wallClockSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+double threadCPUSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+Statistics::Statistics()
+{
+  for (int i=0;i<NumStages;i++) {
+    mWallTime[i] = 0;
+    mCPUTime[i] = 0;
+  }
+
+  for (int i=0;i<NumCounters;i++) {
+    mCounters[i] = 0;
+  }
+
+  for (int i=0;i<NumPipelineStages;i++) {
+    mPipelineBusy[i] = 0;
+    mPipelineCapacity[i] = 0;
+    mPipelineThreads[i] = 0;
+  }
+
+  mMaxSeekForwardFrames = 0;
+  mBytesRead = 0;
+
+  mStartWallTime = wallClockSeconds();
+}
+
+
+void Statistics::addTime(Stage stage, double wallSeconds, double cpuSeconds)
+{
+  mWallTime[stage] += wallSeconds;
+  mCPUTime[stage]  += cpuSeconds;
+}
+
+
+void Statistics::addPipelineLoad(PipelineStage stage, int nThreads,
+                                 double busySeconds, double elapsedSeconds)
+{
+  mPipelineBusy[stage]     += busySeconds;
+  mPipelineCapacity[stage] += nThreads * elapsedSeconds;
+  mPipelineThreads[stage]   = std::max(mPipelineThreads[stage], nThreads);
+}
+
+
+double Statistics::getPipelineUtilization(PipelineStage stage) const
+{
+  return (mPipelineCapacity[stage] > 0 ? mPipelineBusy[stage] / mPipelineCapacity[stage] : 0);
+}
+
+
+void Statistics::addSeekForwardFrames(int n)
+{
+  mCounters[Counter_SeekForwardFrames] += n;
+  if (n > mMaxSeekForwardFrames) {
+    mMaxSeekForwardFrames = n;
+  }
+}
+
+
+const char* Statistics::stageName(Stage stage)
+{
+  switch (stage) {
+  case Stage_Open:      return "open";
+  case Stage_Scan:      return "scan";
+  case Stage_Demux:     return "demux";
+  case Stage_Seek:      return "seek";
+  case Stage_Decode:    return "decode";
+  case Stage_Convert:   return "convert";
+  case Stage_Histogram: return "histogram";
+  case Stage_Selection: return "selection";
+  case Stage_Crop:      return "crop";
+  case Stage_Encode:    return "encode";
+  default: return "unknown";
+  }
+}
+
+
+const char* Statistics::counterName(Counter counter)
+{
+  switch (counter) {
+  case Counter_PacketsDemuxed:    return "packets_demuxed";
+  case Counter_FramesDecoded:     return "frames_decoded";
+  case Counter_FramesUsed:        return "frames_used";
+  case Counter_FramesRejected:    return "frames_rejected";
+  case Counter_FramesEvicted:     return "frames_evicted";
+  case Counter_Seeks:             return "seeks";
+  case Counter_FrameCacheHits:    return "frame_cache_hits";
+  case Counter_PrefetchHits:      return "prefetch_hits";
+  case Counter_SeekForwardFrames: return "seek_forward_frames";
+  default: return "unknown";
+  }
+}
+
+
+const char* Statistics::pipelineStageName(PipelineStage stage)
+{
+  switch (stage) {
+  case Pipeline_Demux:   return "demux";
+  case Pipeline_Decode:  return "decode";
+  case Pipeline_Analyze: return "analyze";
+  case Pipeline_Encode:  return "encode";
+  default: return "unknown";
+  }
+}
+
+
+std::string Statistics::toJSON(const std::string& input) const
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  char buf[200];
+  std::string json = "{\"input\": " + jsonString(input);
+
+  sprintf(buf, ", \"total_wall_time\": %.6f", wallClockSeconds() - mStartWallTime);
+  json += buf;
+
+  json += ", \"stages\": {";
+  for (int i=0;i<NumStages;i++) {
+    sprintf(buf, "%s\"%s\": {\"wall_time\": %.6f, \"cpu_time\": %.6f}",
+            i>0 ? ", " : "", stageName((Stage)i), mWallTime[i], mCPUTime[i]);
+    json += buf;
+  }
+  json += "}";
+
+  json += ", \"pipeline\": {";
+  for (int i=0;i<NumPipelineStages;i++) {
+    sprintf(buf, "%s\"%s\": {\"threads\": %d, \"utilization\": %.3f}",
+            i>0 ? ", " : "", pipelineStageName((PipelineStage)i),
+            mPipelineThreads[i], getPipelineUtilization((PipelineStage)i));
+    json += buf;
+  }
+  json += "}";
+
+  json += ", \"counters\": {";
+  for (int i=0;i<NumCounters;i++) {
+    sprintf(buf, "\"%s\": %lld, ", counterName((Counter)i), (long long)mCounters[i]);
+    json += buf;
+  }
+
+  int64_t nSeeks = mCounters[Counter_Seeks];
+  sprintf(buf, "\"seek_forward_frames_avg\": %.2f, \"seek_forward_frames_max\": %d",
+          nSeeks ? mCounters[Counter_SeekForwardFrames] / double(nSeeks) : 0.0,
+          mMaxSeekForwardFrames);
+  json += buf;
+
+  sprintf(buf, ", \"bytes_read\": %lld, \"peak_rss_kb\": %ld}}",
+          (long long)mBytesRead, usage.ru_maxrss);
+  json += buf;
+
+  return json;
+}
+
+
+void Statistics::writeJSON(FILE* fh, const std::string& input) const
+{
+  fprintf(fh, "%s\n", toJSON(input).c_str());
+}
+
+
+StageTimer::StageTimer(Statistics* stats, Statistics::Stage stage)
+  : mStats(stats),
+    mStage(stage)
+{
+  if (mStats) {
+    mWallStart = wallClockSeconds();
+    mCPUStart  = threadCPUSeconds();
+  }
+}
+
+
+void StageTimer::stop()
+{
+  if (mStats) {
+    mStats->addTime(mStage,
+                    wallClockSeconds() - mWallStart,
+                    threadCPUSeconds() - mCPUStart);
+    mStats = NULL;
+  }
+}
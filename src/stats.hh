@@ -0,0 +1,133 @@
+/*
+ * Extractor
+ * Copyright (c) 2014-2015 Dirk Farin <dirk.farin@gmail.com>
+ *
+ * This file is part of Extractor, a simple video key-frame extration tool.
+ *
+ * Extractor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Extractor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Extractor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_HH
+#define STATS_HH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+
+/* Per-stage timing and counters for one processed input.
+   Wall time and CPU time (of the measuring thread) are accumulated per stage.
+ */
+class Statistics
+{
+public:
+  Statistics();
+
+  enum Stage {
+    Stage_Open,       // avformat open + stream info
+    Stage_Scan,       // demux pass building the frame index
+    Stage_Demux,      // reading packets while decoding
+    Stage_Seek,       // container seeks
+    Stage_Decode,     // video decoding
+    Stage_Convert,    // frame reference / pixel format conversion
+    Stage_Histogram,  // feature computation
+    Stage_Selection,
+    Stage_Crop,
+    Stage_Encode,     // JPEG writing
+    NumStages
+  };
+
+  enum Counter {
+    Counter_PacketsDemuxed,
+    Counter_FramesDecoded,
+    Counter_FramesUsed,
+    Counter_FramesRejected,    // blank/black or boilerplate frames rejected by the pre-filter
+    Counter_FramesEvicted,     // candidate pixels dropped or spilled (memory limit)
+    Counter_Seeks,
+    Counter_FrameCacheHits,
+    Counter_PrefetchHits,      // frames taken from the prefetch buffer
+    Counter_SeekForwardFrames, // frames decoded after a seek until the target was reached
+    NumCounters
+  };
+
+  // Stages of the candidate pipeline, running concurrently on their own threads.
+  enum PipelineStage {
+    Pipeline_Demux,
+    Pipeline_Decode,
+    Pipeline_Analyze,
+    Pipeline_Encode,
+    NumPipelineStages
+  };
+
+  void addTime(Stage, double wallSeconds, double cpuSeconds);
+
+  /* Busy time of all 'nThreads' threads of a pipeline stage, while the stage was
+     running for 'elapsedSeconds'. The utilization is busy / (threads * elapsed).
+   */
+  void addPipelineLoad(PipelineStage, int nThreads, double busySeconds, double elapsedSeconds);
+  double getPipelineUtilization(PipelineStage) const;
+  int    getPipelineThreads(PipelineStage s) const { return mPipelineThreads[s]; }
+  void count(Counter c, int64_t n=1) { mCounters[c] += n; }
+
+  // number of frames decoded forward after a single seek
+  void addSeekForwardFrames(int n);
+
+  void setBytesRead(int64_t n) { mBytesRead = n; }
+
+  // JSON object on a single line
+  std::string toJSON(const std::string& input) const;
+  void writeJSON(FILE* fh, const std::string& input) const;
+
+  static const char* stageName(Stage);
+  static const char* counterName(Counter);
+  static const char* pipelineStageName(PipelineStage);
+
+private:
+  double  mWallTime[NumStages];
+  double  mCPUTime[NumStages];
+  int64_t mCounters[NumCounters];
+
+  double  mPipelineBusy[NumPipelineStages];
+  double  mPipelineCapacity[NumPipelineStages]; // threads * elapsed
+  int     mPipelineThreads[NumPipelineStages];
+
+  int     mMaxSeekForwardFrames;
+  int64_t mBytesRead;
+
+  double  mStartWallTime;
+};
+
+
+/* Adds the wall and CPU time between construction and destruction to a stage.
+   Does nothing if no Statistics object is given.
+ */
+class StageTimer
+{
+public:
+  StageTimer(Statistics* stats, Statistics::Stage stage);
+  ~StageTimer() { stop(); }
+
+  void stop();
+
+private:
+  Statistics* mStats;
+  Statistics::Stage mStage;
+  double mWallStart, mCPUStart;
+};
+
+
+double wallClockSeconds();
+double threadCPUSeconds();
+
+#endif